@@ -5,6 +5,7 @@ LIBS += -L/opt/local/lib/ \
     -lavformat \
     -lSDL \
     -lswscale \
+    -lswresample \
     -lm \
     -lz
 INCLUDEPATH += /opt/local/include/
@@ -5,6 +5,10 @@ extern "C" {
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
 #include <libswscale/swscale.h>
+#include <libswresample/swresample.h>
+#include <libavutil/channel_layout.h>
+#include <libavutil/samplefmt.h>
+#include <libavutil/avassert.h>
 }
 #include <SDL/SDL_main.h>
 #include <SDL/SDL.h>
@@ -13,22 +17,82 @@ extern "C" {
 //#include <stdlib.h>
 //#include <math.h>
 #include <sys/time.h>
+#include <time.h>
+#include <errno.h>
+#include <stddef.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include <iostream>
+#ifdef __DARWIN__
+#include <mach/mach_time.h>
+#endif
 
 using namespace std;
 
-#define SDL_AUDIO_BUFFER_SIZE 1024;
-#define MAX_AUDIOQ_SIZE (5 * 16 * 1024)
-#define MAX_VIDEOQ_SIZE (5 * 256 * 1024)
-#define FF_ALLOC_EVENT   (SDL_USEREVENT)
-#define FF_REFRESH_EVENT (SDL_USEREVENT + 1)
+#define SDL_AUDIO_BUFFER_SIZE 1024
+#define AUDIO_RING_MS 200 /* default decoded audio buffered ahead of the callback */
+#define MAX_AUDIOQ_SIZE (2 * 1024 * 1024) /* byte hard caps, the durations below */
+#define MAX_VIDEOQ_SIZE (32 * 1024 * 1024) /* are what normally stops demux */
+#define MIN_AUDIOQ_SIZE (MAX_AUDIOQ_SIZE / 2) /* demux resumes below these */
+#define MIN_VIDEOQ_SIZE (MAX_VIDEOQ_SIZE / 2)
+#define QUEUE_MAX_MS 2000 /* default high-water mark of both queues */
+#define QUEUE_MIN_MS 1000
+#define MEM_BUDGET_KB (128 * 1024) /* default -membudget, over all queues */
+#define PROBE_SIZE (2 * 1024 * 1024) /* default -probesize, FFmpeg reads up to 5 MB */
+#define ANALYZE_MS 1000 /* default -analyzeduration, FFmpeg's is 5 s */
+#define FIRST_FRAME_WAIT 1000000 /* us audio waits for the first picture, at most */
+#define QUEUE_MIN_BUDGET (256 * 1024) /* smallest share of the budget */
+#define VIDEO_BIT_RATE_GUESS 8000000 /* for streams that don't say */
+#define AUDIO_BIT_RATE_GUESS 256000
+#define PACKET_QUEUE_SIZE 1024 /* slots per packet ring, must be a power of two */
+#define POOL_MIN_SHIFT 8 /* smallest payload buffer, 256 bytes */
+#define POOL_NB_CLASSES 16 /* powers of two up to 8 MB */
+#define POOL_MAX_KB 16384 /* default -poolmax */
+#define FF_WINDOW_EVENT (SDL_USEREVENT) /* open the single-session window on the main thread */
 #define FF_QUIT_EVENT (SDL_USEREVENT + 2)
-#define VIDEO_PICTURE_QUEUE_SIZE 1
+#define PRESENT_POLL_MS 10 /* longest the presentation loop leaves input events and audio wakeups unhandled */
+#define MAX_SESSIONS 16
+#define MULTI_WINDOW_W 1280 /* window shared by several sessions, in a grid */
+#define MULTI_WINDOW_H 720
+#define VIDEO_PICTURE_QUEUE_SIZE 3 /* default pictq depth */
+#define VIDEO_PICTURE_QUEUE_SIZE_MAX 16
+#define FRAME_POOL_SIZE (VIDEO_PICTURE_QUEUE_SIZE_MAX + 20) /* pictq + codec references */
+#define SWS_CACHE_SIZE 4
+#define EXEC_THREADS_MAX 16
+#define EXEC_DEQUE_SIZE 256 /* tasks per worker and priority, must be a power of two */
+#define EXEC_DEQUE_RESERVE 128 /* slots only stages may take, more than MAX_SESSIONS have */
+#define STAGE_STEPS 16 /* steps a stage takes before it lets other tasks run */
+#define CONVERT_SLICE_ALIGN 16 /* slice heights stay whole chroma rows */
+#define CONVERT_BENCH_FRAMES 200
+#define SYNC_TEST_SECONDS 300.0 /* simulated playback per drift rate */
+#define SYNC_TEST_SETTLE 10.0 /* seconds allowed to lock on before checking */
+#define READAHEAD_KB 8192 /* default -readahead */
+#define READAHEAD_CHUNK (512 * 1024) /* largest single read from the file */
+#define AVIO_BUFFER_SIZE 32768
+#define MMAP_WILLNEED (4 << 20) /* mapped bytes paged in ahead of the demuxer */
+#define STATS_SUB_BUCKETS 16 /* per power of two, ~6% resolution */
+#define STATS_NB_BUCKETS (32 * STATS_SUB_BUCKETS)
+#ifndef ENABLE_PROBES
+#define ENABLE_PROBES 1 /* -DENABLE_PROBES=0 compiles the timing probes out */
+#endif
 #define AV_SYNC_THRESHOLD 0.01
 #define AV_NOSYNC_THRESHOLD 10.0
-#define DEFAULT_AV_SYNC_TYPE AV_SYNC_AUDIO_MASTER
+#define CLOCK_DRIFT_JUMP 0.1 /* an update further off than this is a discontinuity */
+#define CLOCK_DRIFT_MIN_TIME 2.0 /* seconds of updates needed to estimate drift */
+#define SKIP_NONREF_LAG 0.1 /* seconds behind the master clock before skipping non-reference frames */
+#define SKIP_NONREF_FRAMES 5 /* ... for this many decoded frames in a row */
+#define SKIP_TO_KEY_LAG 0.5 /* so far behind that packets are dropped up to the next keyframe */
 #define SAMPLE_CORRECTION_PERCENT_MAX 10
 #define AUDIO_DIFF_AVG_NB 20
+#define SPEED_MIN 0.25
+#define SPEED_MAX 4.0
+#define SKIP_NONREF_SPEED 2.0 /* from here on non-reference frames are never decoded */
+#define STRETCH_WINDOW_MS 40 /* segment copied from the input per step */
+#define STRETCH_OVERLAP_MS 8 /* crossfade between consecutive segments */
+#define STRETCH_SEEK_MS 15 /* range searched for the best matching segment */
 
 enum {
     AV_SYNC_AUDIO_MASTER,
@@ -36,34 +100,432 @@ enum {
     AV_SYNC_EXTERNAL_MASTER,
 };
 
+enum {
+    PACKET_QUEUE_WAIT_NONE,
+    PACKET_QUEUE_WAIT_DATA,  /* consumer parked until a packet is queued */
+    PACKET_QUEUE_WAIT_SLOT,  /* producer parked until a slot is freed */
+    PACKET_QUEUE_WAIT_SPACE, /* producer parked until the low-water mark */
+};
+
+enum {
+    STAGE_STOPPED, /* not started yet, or ended */
+    STAGE_IDLE,    /* parked, waits for stage_wake */
+    STAGE_QUEUED,  /* its task is on the executor */
+    STAGE_RUNNING,
+    STAGE_RERUN,   /* woken while running, steps again instead of parking */
+};
+
+enum {
+    STEP_AGAIN,  /* more to do right away */
+    STEP_PARKED, /* waits for another stage or thread to wake it */
+    STEP_DONE,   /* the stage ended */
+};
+
+struct PacketPool;
+struct Stage;
+
+/* Header in front of every pooled payload */
+typedef struct PoolBuffer {
+    struct PacketPool *pool;
+    struct PoolBuffer *next; /* in the free list */
+    int cls;
+} PoolBuffer;
+
+#define POOL_HEADER_SIZE FFALIGN((int)sizeof(PoolBuffer), 32)
+
+/* Per-session payload buffers for the packets packet_queue_put has to copy,
+   in power of two size classes, recycled when the packet is freed. All
+   buffers, free or in use, count against max_bytes; past it packets are
+   copied with av_dup_packet as before. */
+typedef struct PacketPool {
+    SDL_mutex *mutex; /* demux allocates, the decoders free */
+    PoolBuffer *free_list[POOL_NB_CLASSES];
+    int64_t bytes, peak_bytes, max_bytes;
+    int hits, misses, capped;
+} PacketPool;
+
+/* Single producer / single consumer ring of preallocated packet slots.
+   windex is only written by the producer and rindex only by the consumer,
+   so it needs no lock. Neither side ever sleeps: the producer and consumer
+   stages park when the ring is empty or full, or when demux waits for the
+   queue to drain below its low-water mark, and the other side wakes them.
+   nb_packets, size and duration can be read at any time. */
 typedef struct PacketQueue {
-    AVPacketList *first_pkt, *last_pkt;
-    int nb_packets;
+    AVPacket pkts[PACKET_QUEUE_SIZE];
+    volatile unsigned int windex;
+    volatile unsigned int rindex;
+    volatile int nb_packets;
+    volatile int size;
+    volatile int duration; /* microseconds of media queued */
+    AVRational time_base;  /* of the packets, used for duration */
+    int max_size, min_size; /* byte high/low-water marks in effect */
+    int cap_size, cap_min_size; /* as configured, max_size never exceeds it */
+    int max_duration, min_duration; /* microseconds, 0 means no limit */
+    int bit_rate; /* expected, sets the queue's share of the memory budget */
+    volatile int producer_waiting; /* PACKET_QUEUE_WAIT_*, demux parked on it */
+    volatile int consumer_waiting; /* PACKET_QUEUE_WAIT_*, decoder parked on it */
+    struct Stage *producer, *consumer; /* woken when what they wait for is there */
+    volatile int serial; /* flushes queued by the producer */
+    int consumer_serial; /* flushes the consumer got through */
+    volatile int abort_request; /* session closing, fail both sides */
+    int copies; /* payloads av_dup_packet had to copy, producer only */
+    int64_t bytes_copied;
+    PacketPool *pool; /* for those copies, NULL to always use av_dup_packet */
+} PacketQueue;
+
+/* Probes, each one is only ever recorded by the thread or stage named
+   here, and a stage never runs on two workers at once, so the
+   histograms need neither locks nor atomics. Stage probes are latencies in
+   microseconds, the others sampled values. */
+enum {
+    PROBE_DEMUX,          /* av_read_frame, demux stage */
+    PROBE_PACKET_PUT,     /* packet_queue_put, demux stage */
+    PROBE_VIDEOQ_GET,     /* packet_queue_get that found a packet, video stage */
+    PROBE_VIDEO_DECODE,   /* avcodec_decode_video2, video stage */
+    PROBE_CONVERT,        /* picture conversion, video stage */
+    PROBE_AUDIOQ_GET,     /* packet_queue_get that found a packet, audio stage */
+    PROBE_AUDIO_DECODE,   /* decode + resample, audio stage */
+    PROBE_AUDIO_CALLBACK, /* SDL audio thread */
+    PROBE_DISPLAY,        /* overlay upload + SDL_DisplayYUVOverlay, main thread */
+    PROBE_AUDIOQ_PACKETS, /* queue depths, sampled by the demux stage per packet */
+    PROBE_AUDIOQ_BYTES,
+    PROBE_VIDEOQ_PACKETS,
+    PROBE_VIDEOQ_BYTES,
+    PROBE_PICTQ_SIZE,     /* sampled per refresh, main thread */
+    PROBE_AV_DIFF,        /* |video - master clock| in microseconds, main thread */
+    PROBE_PRESENT_LATE,   /* picture shown after its deadline by, main thread */
+    PROBE_FRAME_INTERVAL, /* between two shown pictures, main thread */
+    PROBE_NB,
+};
+
+enum {
+    PROBES_FORMAT_JSON,
+    PROBES_FORMAT_CSV,
+};
+
+/* Log-linear histogram of non-negative values */
+typedef struct Histogram {
+    unsigned int count;
+    int64_t total, max;
+    unsigned int buckets[STATS_NB_BUCKETS];
+} Histogram;
+
+typedef struct Probes {
+#if ENABLE_PROBES
+    Histogram hist[PROBE_NB];
+#endif
+    unsigned int video_frames, audio_frames;
+    FILE *out; /* -stats file, NULL if not dumping */
+    int format; /* PROBES_FORMAT_* */
+    int64_t start, last_dump;
+} Probes;
+
+#if ENABLE_PROBES
+#define PROBE_START(t) int64_t t = clock_monotonic_us()
+#define PROBE_END(is, id, t) hist_add(&(is)->probes.hist[id], clock_monotonic_us() - (t))
+#define PROBE_VALUE(is, id, v) hist_add(&(is)->probes.hist[id], v)
+#else
+#define PROBE_START(t)
+#define PROBE_END(is, id, t) do {} while(0)
+#define PROBE_VALUE(is, id, v) do {} while(0)
+#endif
+
+/* Single producer / single consumer ring of decoded PCM bytes, filled by
+   the audio stage and drained by the SDL audio callback. The callback never
+   blocks: it takes what is there and counts an underrun otherwise. The
+   stage parks when the ring holds 'depth' bytes. The callback only flags
+   that it made room, pcm_ring_poll on the main thread wakes the stage. */
+typedef struct PcmRing {
+    uint8_t *buf;
+    unsigned int capacity; /* power of two >= depth */
+    unsigned int depth; /* bytes the producer may buffer ahead */
+    volatile unsigned int windex; /* running byte counts */
+    volatile unsigned int rindex;
+    volatile int underruns; /* callbacks that ran out of data */
+    volatile int fill_samples; /* fill level seen by the callbacks while playing */
+    unsigned int fill_min; /* bytes */
+    int64_t fill_total;
+    volatile int waiting; /* producer parked until there is space */
+    volatile int wake_pending; /* the callback made room for a parked producer */
+    volatile int abort_request; /* session closing */
+    struct Stage *stage; /* the producer */
+    volatile unsigned int pts_seq; /* seqlock for the fields below */
+    double end_pts; /* pts of the data ending at end_windex, NAN until known */
+    unsigned int end_windex;
+    double speed; /* media seconds per second of the data */
+} PcmRing;
+
+/* Pitch preserving time stretch of interleaved S16 (WSOLA): the output is
+   made of overlapping segments of the input, each taken where it matches
+   the end of the previous one best, and spaced 'speed' times further apart
+   in the input than in the output. */
+typedef struct TimeStretch {
+    int channels;
+    int window, overlap, seek; /* frames */
+    int16_t *in; /* input not consumed yet */
+    int in_frames;
+    unsigned int in_size; /* bytes allocated */
+    int16_t *mid; /* end of the previous segment, crossfaded into the next */
+    int have_mid;
+    double skip_frac; /* input to skip that did not make a whole frame yet */
+    int16_t *out;
+    unsigned int out_size;
+} TimeStretch;
+
+/* A clock that keeps running between updates: it read 'pts' at monotonic
+   time 'last_updated' and advances 'speed' seconds per second unless paused.
+   It has a single writer at a time, readers never block: they retry while
+   seq is odd or changed under them (seqlock). */
+typedef struct Clock {
+    volatile unsigned int seq;
+    double pts; /* NAN until first set */
+    double last_updated; /* monotonic seconds */
+    double speed;
+    int paused;
+    double drift; /* rate against the monotonic clock, relative to speed, minus 1 */
+    double ref_pts, ref_time; /* start of the drift measurement, writer only */
+} Clock;
+
+/* Video keyframes of a file without a usable index, found by scanning it
+   in the background on the first seek. Appended by an executor task and
+   searched by the demux stage, both under mutex. */
+typedef struct KeyframeIndex {
+    int64_t *pts; /* stream time base, ascending */
+    int64_t *pos; /* byte position of the keyframe packet */
+    int nb_entries, nb_allocated;
+    int64_t last_pts; /* scanned up to here */
+    volatile int complete; /* scanned to the end of file */
+    SDL_mutex *mutex;
+} KeyframeIndex;
+
+/* Byte ring in front of a local file, filled by executor tasks in large
+   chunks so that the demuxer's many small reads never wait on the disk
+   while data is in flight. The ring holds the file range [start, fill_pos),
+   the demuxer reads at pos in it, a fill task refills whatever pos left
+   behind. Short seeks inside the range cost nothing. A demuxer that finds
+   the ring empty and no read in flight reads the next chunk itself, it
+   never waits for a task that may be queued behind it. */
+typedef struct ReadAhead {
+    int fd;
+    int64_t file_size;
+    uint8_t *buf;
     int size;
+    int64_t start, pos, fill_pos; /* file offsets, protected by mutex */
+    unsigned int generation; /* bumped when a seek drops the ring */
+    int eof, error;
+    int abort_request;
+    int stalls; /* reads that found the ring empty */
+    int64_t bytes_read; /* into the ring */
+    int64_t bytes_copied; /* out of the ring */
+    struct Executor *exec; /* runs the fill tasks, NULL to read on demand only */
+    int fill_queued; /* a fill task is queued or running */
+    int filling; /* a chunk is being read, by the task or a stalled demuxer */
     SDL_mutex *mutex;
-    SDL_cond *cond;
-} PacketQueue;
+    SDL_cond *cond; /* chunk read or fill task ended */
+} ReadAhead;
+
+/* A local file mapped read-only, shared by the demuxers reading it and
+   unmapped when the last one lets go of it. */
+typedef struct MappedFile {
+    uint8_t *data;
+    int64_t size;
+    volatile int refcount;
+} MappedFile;
+
+/* One demuxer's position in a MappedFile. Its AVIOContext is direct, so
+   packet payloads are copied straight out of the mapping, once. */
+typedef struct MmapReader {
+    MappedFile *map;
+    int64_t pos;
+    int64_t advised; /* paged in up to here */
+    int64_t bytes_copied;
+} MmapReader;
+
+typedef struct PlayerOptions {
+    int audioq_max_size, audioq_min_size;
+    int audioq_max_duration, audioq_min_duration; /* ms */
+    int videoq_max_size, videoq_min_size;
+    int videoq_max_duration, videoq_min_duration; /* ms */
+    int pictq_depth; /* decoded pictures buffered ahead of the display */
+    int convert_threads; /* executor workers, 0 means one per core */
+    int convert_bench; /* benchmark the conversion instead of playing */
+    int video_threads; /* decoder threads, 0 means one per core */
+    const char *video_thread_type; /* "frame", "slice" or "auto" */
+    int audio_ring_ms; /* decoded audio buffered ahead of the callback */
+    int headless; /* decode as fast as possible into null sinks, then report */
+    double speed; /* initial playback speed */
+    const char *sync_type; /* master clock: "audio", "video" or "ext" */
+    const char *stats_file; /* probe dump, "-" for stderr */
+    const char *stats_format; /* "json" or "csv" */
+    int stats_interval; /* ms between dumps, 0 dumps only on exit */
+    int readahead_kb; /* read-ahead ring for local files, 0 uses FFmpeg's own I/O */
+    int mmap_input; /* map local files instead of reading them */
+    int io_bench; /* compare the input modes instead of playing */
+    int sync_test; /* check the audio drift correction instead of playing */
+    int pool_max_kb; /* packet payload pool cap per session */
+    int mem_budget_kb; /* over all packet queues of all sessions */
+    int probe_size; /* bytes avformat_find_stream_info may read, 0 for FFmpeg's default */
+    int analyze_ms; /* media it may analyze, 0 for FFmpeg's default */
+} PlayerOptions;
+
+/* Frame buffer handed to the codec by video_get_buffer (direct rendering),
+   so that YUV420P frames can be queued for display without any copy.
+   Referenced by the codec and by every pictq entry showing it. */
+typedef struct FrameBuffer {
+    AVPicture pict;
+    int width, height; /* allocated (aligned) size */
+    volatile int refcount;
+} FrameBuffer;
+
+typedef struct SwsCacheEntry {
+    struct SwsContext *ctx;
+    int src_w, src_h, src_fmt;
+    int dst_w, dst_h, dst_fmt;
+    int flags;
+    unsigned int last_used;
+} SwsCacheEntry;
+
+/* A few scaler contexts, so that geometry changes don't rebuild them */
+typedef struct SwsCache {
+    SwsCacheEntry entries[SWS_CACHE_SIZE];
+    unsigned int clock;
+} SwsCache;
 
+enum {
+    TASK_PRIO_FOCUS, /* work for the session the keys act on */
+    TASK_PRIO_NORMAL,
+    TASK_PRIO_BACKGROUND, /* long jobs nobody waits for */
+    TASK_PRIO_NB,
+};
+
+struct ExecWorker;
+struct VideoState;
+
+typedef struct Task {
+    void (*run)(void *opaque, struct ExecWorker *w);
+    void *opaque;
+} Task;
+
+/* The owner pushes and pops at the bottom, thieves take from the top */
+typedef struct TaskDeque {
+    Task tasks[EXEC_DEQUE_SIZE];
+    unsigned int top, bottom;
+} TaskDeque;
+
+typedef struct ExecWorker {
+    struct Executor *exec;
+    SDL_Thread *tid;
+    SDL_mutex *mutex; /* protects the deques */
+    TaskDeque deques[TASK_PRIO_NB];
+    SwsCache sws_cache; /* each worker scales its slices with its own contexts */
+} ExecWorker;
+
+/* One set of threads, one per core, for all the work of all sessions:
+   their pipeline stages, read-ahead, conversion slices and keyframe index
+   scans. Tasks are spread over the workers' deques, idle workers steal,
+   higher priorities first. Only the SDL audio callback and the main
+   thread, which SDL wants for the display and events, run elsewhere. */
+typedef struct Executor {
+    ExecWorker workers[EXEC_THREADS_MAX];
+    int nb_workers;
+    SDL_mutex *mutex; /* idle workers sleep on cond */
+    SDL_cond *cond;
+    volatile unsigned int wakeups; /* bumped under mutex whenever cond is signalled */
+    volatile int nb_queued;
+    volatile int nb_background; /* workers running a background task */
+    volatile unsigned int next_worker; /* where the next task is queued */
+    volatile int executed, stolen;
+    int quit;
+} Executor;
+
+/* A pipeline stage of a session (open/demux, video decode, audio decode)
+   run on the executor one step at a time. A step does a bounded amount of
+   work and never sleeps on another stage: when it has to wait it parks,
+   returning STEP_PARKED after publishing what it waits for, and whoever
+   provides that calls stage_wake. A stage never runs on two workers at
+   once. */
+typedef struct Stage {
+    Executor *exec;
+    int (*step)(struct VideoState *is); /* STEP_*, may switch to the next phase */
+    struct VideoState *is;
+    volatile int state; /* STAGE_* */
+} Stage;
+
+/* A picture converted as horizontal slices, by the caller and whichever
+   workers pick up its tickets. */
+typedef struct ConvertJob {
+    SDL_mutex *mutex;
+    SDL_cond *done_cond;
+    /* current conversion, protected by mutex */
+    unsigned int generation; /* a ticket helps whichever conversion is current when it runs */
+    AVPicture *src, *dst;
+    int src_fmt, dst_fmt, width, height, flags;
+    int slice_height, nb_slices, next_slice, slices_done;
+    SwsCache sws_cache; /* for the slices the caller converts */
+} ConvertJob;
+
+/* Pictures are converted into decoder-owned YUV420P buffers, the main
+   thread only uploads the one being shown into the display overlay.
+   YUV420P frames from direct rendering are referenced instead. */
 typedef struct VideoPicture {
-    SDL_Overlay *bmp;
+    AVPicture pict; /* planes to show, points into buf or fb */
+    AVPicture buf;  /* conversion buffer */
+    FrameBuffer *fb;
     int width, height; /* source height & width */
-    int allocated;
+    int allocated; /* buf, only converted pictures need it */
+    int buf_width, buf_height;
     double pts;
+    int serial; /* videoq flushes the decoder had seen, stale after a seek */
 } VideoPicture;
 
+/* Process wide state shared by the sessions: the window, the audio device
+   they are mixed into and the executor running their work. */
+typedef struct Player {
+    struct VideoState *sessions[MAX_SESSIONS];
+    int nb_sessions;
+    int focus; /* session the keys act on */
+    int headless;
+    SDL_Surface *screen;
+    SDL_mutex *audio_mutex; /* opening the device */
+    int audio_open;
+    SDL_AudioSpec audio_spec;
+    uint8_t *mix_buf; /* one session's share of a callback */
+    Executor *exec;
+    SDL_mutex *present_mutex;
+    SDL_cond *present_cond; /* a session queued a picture or finished */
+    SDL_mutex *budget_mutex;
+    int64_t mem_budget; /* bytes over all packet queues, 0 for none */
+} Player;
+
 typedef struct VideoState {
 
     AVFormatContext *pFormatCtx;
     int             videoStream, audioStream;
     int             av_sync_type;
-    double          external_clock; /* external clock base */
-    int64_t         external_clock_time;
+    Clock           audclk; /* what is heard, written by the audio callback */
+    Clock           vidclk; /* what is shown, written by the main thread */
+    Clock           extclk; /* follows the video clock, written by the main thread */
+    int             paused;
     double          audio_clock;
     AVStream        *audio_st;
     PacketQueue     audioq;
-    uint8_t         audio_buf[(AVCODEC_MAX_AUDIO_FRAME_SIZE * 3) / 2];
+    AVFrame         *audio_frame;
+    uint8_t         *audio_buf; /* converted samples, reused across frames */
     unsigned int    audio_buf_size;
-    unsigned int    audio_buf_index;
+    struct SwrContext *swr_ctx;
+    int             audio_src_fmt, audio_src_freq; /* what swr_ctx converts from */
+    int64_t         audio_src_layout;
+    int             audio_out_fmt; /* and to: the device's, or S16 while stretching */
+    int             audio_tgt_fmt, audio_tgt_freq, audio_tgt_channels; /* device */
+    int64_t         audio_tgt_layout;
+    int             audio_tgt_frame_size; /* bytes per sample frame on the device */
+    PcmRing         audio_ring;
+    TimeStretch     stretch;
+    struct SwrContext *stretch_swr; /* stretcher output (S16) to the device format */
+    uint8_t         *stretch_buf;
+    unsigned int    stretch_buf_size;
+    volatile double speed; /* playback speed, written by the main thread */
+    int             audio_bytes_per_sec;
     AVPacket        audio_pkt;
     uint8_t         *audio_pkt_data;
     int             audio_pkt_size;
@@ -76,777 +538,3218 @@ typedef struct VideoState {
     double          frame_last_pts;
     double          frame_last_delay;
     double          video_clock; ///<pts of last decoded frame / predicted pts of next decoded frame
-    double          video_current_pts; ///<current displayed pts (different from video_clock if frame fifos are used)
-    int64_t         video_current_pts_time;  ///<time (av_gettime) at which we updated video_current_pts - used to have running video pts
+    double          video_last_pts; ///<last timestamp taken from the decoder
+    int             video_pts_errors; ///<pictures whose timestamp went backwards
+    int64_t         refresh_deadline; /* monotonic us of the next video refresh */
+    int64_t         present_deadline; /* deadline of the refresh in progress */
+    int64_t         last_present; /* monotonic us the previous picture was shown */
     AVStream        *video_st;
     PacketQueue     videoq;
-    VideoPicture    pictq[VIDEO_PICTURE_QUEUE_SIZE];
+    VideoPicture    pictq[VIDEO_PICTURE_QUEUE_SIZE_MAX];
+    int             pictq_depth; /* entries of pictq in use */
     int             pictq_size, pictq_rindex, pictq_windex;
+    int             frame_drops_late; /* pictures dropped by the refresh */
+    int             frame_drops_packets; /* video packets dropped before decode */
+    int             frame_skips_nonref; /* non-reference frames the decoder dropped, see video_step */
+    int             video_decoder_primed; /* a picture came out since open or the last flush */
+    int             video_late_frames; /* consecutive decoded frames over SKIP_NONREF_LAG */
+    int             video_skip_to_key; /* dropping packets until the next keyframe */
+    int             seek_req; /* protected by seek_mutex */
+    int64_t         seek_pos; /* AV_TIME_BASE */
+    KeyframeIndex   kf_index;
+    int             video_seeking, audio_seeking; /* decoding forward to the seek target */
+    double          video_seek_target, audio_seek_target;
+    int             frame_serial; /* serial of the picture last shown, -1 for none */
+    int             frame_repeats; /* refreshes that kept the previous picture up */
+    SDL_Overlay     *bmp; /* display surface, only touched by the main thread */
+    FrameBuffer     frame_pool[FRAME_POOL_SIZE];
+    SwsCache        sws_cache;
+    ConvertJob      convert_job;
+    ReadAhead       readahead;
+    MmapReader      mmap_reader; /* instead of readahead with -mmap */
+    PacketPool      packet_pool;
     SDL_mutex       *pictq_mutex;
-    SDL_cond        *pictq_cond;
-    SDL_Thread      *parse_tid;
-    SDL_Thread      *video_tid;
+    volatile int    pictq_waiting; /* video stage parked until pictq has room */
+    Stage           demux_stage; /* opens the input, then demuxes */
+    Stage           audio_open_stage; /* opens the audio codec meanwhile */
+    Stage           video_stage;
+    Stage           audio_stage;
+    volatile int    opens_pending; /* codec opens the demux stage waits for */
+    int             audio_open_ret, video_open_ret;
+    AVPacket        video_pkt; /* being decoded, empty while draining at EOF */
+    AVFrame         *video_frame;
+    int             video_frame_ready; /* decoded, waits for room in pictq */
+    double          video_frame_pts;
+    int             video_draining; /* getting the delayed pictures out at EOF */
+    uint8_t         *audio_out; /* decoded audio not in audio_ring yet, or NULL */
+    int             audio_out_size;
+    double          audio_out_latency, audio_out_speed; /* for its pcm_ring_set_pts */
     char            filename[1024];
+    PlayerOptions   opts;
+    int             eof;
+    int             read_error; /* demux stopped on it, waits for quit */
+    int             video_finished, audio_finished; /* decoders reached EOF */
+    Probes          probes;
+    SDL_mutex       *seek_mutex;
     int             quit;
+    Player          *player;
+    int             index; /* in player->sessions */
+    int             audio_ready; /* audio_ring can be mixed */
+    /* startup, on the monotonic clock */
+    int64_t         open_time, probe_time, codecs_time;
+    int64_t         audio_ready_time;
+    volatile int64_t first_frame_time; /* 0 until the first picture is shown */
 
 } VideoState;
 
-int quit = 0; //global variable used to control the audio packet flow
-PacketQueue audioq;
-SDL_Surface     *screen;
-VideoState *global_video_state;
-uint64_t global_video_pkt_pts = AV_NOPTS_VALUE;
-
-void packet_queue_init(PacketQueue *q) {
-    memset(q, 0, sizeof(PacketQueue));
-    q->mutex = SDL_CreateMutex();
-    q->cond = SDL_CreateCond();
-}
+AVPacket flush_pkt; /* marker queued on seek, its data is only compared against */
 
-int packet_queue_put(PacketQueue *q, AVPacket *pkt) {
+/* Monotonic microseconds, unaffected by wall clock changes. Timing of the
+   display and the probes use this, av_gettime is the wall clock. */
+int64_t clock_monotonic_us(void) {
+#ifdef __DARWIN__
+    static mach_timebase_info_data_t tb;
 
-    AVPacketList *pkt1;
-    if(av_dup_packet(pkt) < 0) {
-        return -1;
-    }
-    pkt1 = (AVPacketList *)av_malloc(sizeof(AVPacketList));
-    if (!pkt1){
-        return -1;
+    if(!tb.denom) {
+        mach_timebase_info(&tb);
     }
-    pkt1->pkt = *pkt;
-    pkt1->next = NULL;
-
+    return (int64_t)(mach_absolute_time() * ((double)tb.numer / tb.denom) / 1000.0);
+#else
+    struct timespec ts;
 
-    if(SDL_LockMutex(q->mutex)==0){
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
 
-        if (!q->last_pkt){
-            q->first_pkt = pkt1;
-        }
-        else{
-            q->last_pkt->next = pkt1;
-        }
-        q->last_pkt = pkt1;
-        q->nb_packets++;
-        q->size += pkt1->pkt.size;
-        SDL_CondSignal(q->cond);
+/* Sleep until a clock_monotonic_us deadline. Both are absolute waits on
+   the monotonic clock, precise well below a millisecond unlike SDL timers. */
+void clock_sleep_until(int64_t deadline) {
+#ifdef __DARWIN__
+    static mach_timebase_info_data_t tb;
 
-        SDL_UnlockMutex(q->mutex);
-        return 0;
+    if(!tb.denom) {
+        mach_timebase_info(&tb);
     }
-    else{
-        return -1;
+    mach_wait_until((uint64_t)(deadline * 1000.0 * tb.denom / tb.numer));
+#else
+    struct timespec ts;
+
+    ts.tv_sec = deadline / 1000000;
+    ts.tv_nsec = (deadline % 1000000) * 1000;
+    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
     }
+#endif
 }
 
-static int packet_queue_get(PacketQueue *q, AVPacket *pkt, int block) {
-    AVPacketList *pkt1;
-    int ret;
+static unsigned int seqlock_read_begin(volatile unsigned int *seq) {
+    unsigned int s;
 
-    if(SDL_LockMutex(q->mutex)==0){
+    while((s = *seq) & 1) {
+        /* writer in the middle of an update */
+    }
+    __sync_synchronize();
+    return s;
+}
 
-        for(;;) {
+static int seqlock_read_retry(volatile unsigned int *seq, unsigned int s) {
+    __sync_synchronize();
+    return *seq != s;
+}
 
-            if(quit) {
-                ret = -1;
-                break;
-            }
+static void seqlock_write_begin(volatile unsigned int *seq) {
+    (*seq)++;
+    __sync_synchronize();
+}
 
-            pkt1 = q->first_pkt;
-            if (pkt1) {
-                q->first_pkt = pkt1->next;
-                if (!q->first_pkt)
-                    q->last_pkt = NULL;
-                q->nb_packets--;
-                q->size -= pkt1->pkt.size;
-                *pkt = pkt1->pkt;
-                av_free(pkt1);
-                ret = 1;
-                break;
-            } else if (!block) {
-                ret = 0;
-                break;
-            } else {
-                SDL_CondWait(q->cond, q->mutex);
-            }
-        }
-        SDL_UnlockMutex(q->mutex);
-        return ret;
-    }
-    else{
-        SDL_CondWait(q->cond, q->mutex);
-        for(;;) {
+static void seqlock_write_end(volatile unsigned int *seq) {
+    __sync_synchronize();
+    (*seq)++;
+}
 
-            if(quit) {
-                ret = -1;
-                break;
-            }
+void clock_init(Clock *c) {
+    memset(c, 0, sizeof(Clock));
+    c->pts = NAN;
+    c->speed = 1.0;
+}
 
-            pkt1 = q->first_pkt;
-            if (pkt1) {
-                q->first_pkt = pkt1->next;
-                if (!q->first_pkt)
-                    q->last_pkt = NULL;
-                q->nb_packets--;
-                q->size -= pkt1->pkt.size;
-                *pkt = pkt1->pkt;
-                av_free(pkt1);
-                ret = 1;
-                break;
-            } else if (!block) {
-                ret = 0;
-                break;
-            } else {
-                SDL_CondWait(q->cond, q->mutex);
-            }
-        }
-        SDL_UnlockMutex(q->mutex);
-        return ret;
+static double clock_now(void) {
+    return clock_monotonic_us() / 1000000.0;
+}
+
+double clock_get(Clock *c) {
+    unsigned int seq;
+    double pts, last_updated, speed;
+    int paused;
+
+    do {
+        seq = seqlock_read_begin(&c->seq);
+        pts = c->pts;
+        last_updated = c->last_updated;
+        speed = c->speed;
+        paused = c->paused;
+    } while(seqlock_read_retry(&c->seq, seq));
+
+    if(paused) {
+        return pts;
     }
+    return pts + (clock_now() - last_updated) * speed;
 }
 
-int audio_decode_frame(VideoState *is, uint8_t *audio_buf, int buf_size, double *pts_ptr) {
+double clock_get_drift(Clock *c) {
+    unsigned int seq;
+    double drift;
 
-    int len1, data_size, n;
-    AVPacket *pkt = &is->audio_pkt;
-    double pts;
+    do {
+        seq = seqlock_read_begin(&c->seq);
+        drift = c->drift;
+    } while(seqlock_read_retry(&c->seq, seq));
+    return drift;
+}
 
-    for(;;) {
-        while(is->audio_pkt_size > 0) {
-            data_size = buf_size;
-            len1 = avcodec_decode_audio2(is->audio_st->codec,
-                                         (int16_t *)audio_buf, &data_size,
-                                         is->audio_pkt_data, is->audio_pkt_size);
-            //len1 = avcodec_decode_audio3(is->audio_st->codec, (int16_t *)audio_buf, &data_size, pkt);
+/* The clock read 'pts' at monotonic time 'time'. Updates that keep within
+   CLOCK_DRIFT_JUMP of where the clock would have run to measure its drift,
+   over CLOCK_DRIFT_MIN_TIME at least, anything else restarts the measurement. */
+void clock_set_at(Clock *c, double pts, double time) {
+    double expected = c->pts + (time - c->last_updated) * c->speed;
+    double drift = c->drift;
+
+    if(c->paused || isnan(c->pts) || fabs(pts - expected) > CLOCK_DRIFT_JUMP) {
+        c->ref_pts = pts;
+        c->ref_time = time;
+    } else if(time - c->ref_time >= CLOCK_DRIFT_MIN_TIME) {
+        drift = (pts - c->ref_pts) / ((time - c->ref_time) * c->speed) - 1.0;
+    }
 
-            if(len1 < 0) {
-                /* if error, skip frame */
-                is->audio_pkt_size = 0;
-                break;
-            }
-            is->audio_pkt_data += len1;
-            is->audio_pkt_size -= len1;
-            if(data_size <= 0) {
-                /* No data yet, get more frames */
-                continue;
-            }
-            pts = is->audio_clock;
-            *pts_ptr = pts;
-            n = 2 * is->audio_st->codec->channels;
-            is->audio_clock += (double)data_size /
-                               (double)(n * is->audio_st->codec->sample_rate);
+    seqlock_write_begin(&c->seq);
+    c->pts = pts;
+    c->last_updated = time;
+    c->drift = drift;
+    seqlock_write_end(&c->seq);
+}
 
-            /* We have data, return it and come back for more later */
-            return data_size;
-        }
-        if(pkt->data)
-            av_free_packet(pkt);
+void clock_set(Clock *c, double pts) {
+    clock_set_at(c, pts, clock_now());
+}
 
-        if(is->quit) {
-            return -1;
-        }
-        /* next packet */
-        if(packet_queue_get(&is->audioq, pkt, 1) < 0) {
-            return -1;
-        }
-        is->audio_pkt_data = pkt->data;
-        is->audio_pkt_size = pkt->size;
-        /* if update, update the audio clock w/pts */
-        if(pkt->pts != AV_NOPTS_VALUE) {
-            is->audio_clock = av_q2d(is->audio_st->time_base)*pkt->pts;
-        }
+/* Freeze or restart the clock where it is. */
+void clock_set_paused(Clock *c, int paused) {
+    double time = clock_now(), pts = clock_get(c);
+
+    seqlock_write_begin(&c->seq);
+    c->pts = pts;
+    c->last_updated = time;
+    c->paused = paused;
+    seqlock_write_end(&c->seq);
+    c->ref_pts = pts;
+    c->ref_time = time;
+}
 
-    }
+void clock_set_speed(Clock *c, double speed) {
+    double time = clock_now(), pts = clock_get(c);
 
+    seqlock_write_begin(&c->seq);
+    c->pts = pts;
+    c->last_updated = time;
+    c->speed = speed;
+    seqlock_write_end(&c->seq);
+    c->ref_pts = pts;
+    c->ref_time = time;
 }
 
-double get_audio_clock(VideoState *is) {
-    double pts;
-    int hw_buf_size, bytes_per_sec, n;
+/* Reset 'c' to 'slave' when unset or too far off, how the external clock
+   stays related to the media. */
+void clock_sync_to_slave(Clock *c, Clock *slave) {
+    double clock = clock_get(c), slave_clock = clock_get(slave);
 
-    pts = is->audio_clock; /* maintained in the audio thread */
-    hw_buf_size = is->audio_buf_size - is->audio_buf_index;
-    bytes_per_sec = 0;
-    n = is->audio_st->codec->channels * 2;
-    if(is->audio_st) {
-        bytes_per_sec = is->audio_st->codec->sample_rate * n;
-    }
-    if(bytes_per_sec) {
-        pts -= (double)hw_buf_size / bytes_per_sec;
+    if(!isnan(slave_clock) && (isnan(clock) || fabs(clock - slave_clock) > AV_NOSYNC_THRESHOLD)) {
+        clock_set(c, slave_clock);
     }
-    return pts;
 }
 
-double get_video_clock(VideoState *is) {
-    double delta;
+static int hist_bucket(int64_t v) {
+    int e;
 
-    delta = (av_gettime() - is->video_current_pts_time) / 1000000.0;
-    return is->video_current_pts + delta;
+    if(v < STATS_SUB_BUCKETS) {
+        return v < 0 ? 0 : (int)v;
+    }
+    v = FFMIN(v, (int64_t)UINT_MAX);
+    e = av_log2((unsigned int)v);
+    return FFMIN((e - 3) * STATS_SUB_BUCKETS + (int)((v >> (e - 4)) & (STATS_SUB_BUCKETS - 1)),
+                 STATS_NB_BUCKETS - 1);
 }
 
-double get_external_clock(VideoState *is) {
-    return av_gettime() / 1000000.0;
+/* lower bound of a bucket */
+static int64_t hist_bucket_value(int i) {
+    if(i < STATS_SUB_BUCKETS) {
+        return i;
+    }
+    return (int64_t)(STATS_SUB_BUCKETS + i % STATS_SUB_BUCKETS) << (i / STATS_SUB_BUCKETS - 1);
 }
 
-double get_master_clock(VideoState *is) {
-    if(is->av_sync_type == AV_SYNC_VIDEO_MASTER) {
-        return get_video_clock(is);
-    } else if(is->av_sync_type == AV_SYNC_AUDIO_MASTER) {
-        return get_audio_clock(is);
-    } else {
-        return get_external_clock(is);
+void hist_add(Histogram *h, int64_t v) {
+    h->count++;
+    h->total += v;
+    h->max = FFMAX(h->max, v);
+    h->buckets[hist_bucket(v)]++;
+}
+
+int64_t hist_percentile(Histogram *h, double pct) {
+    unsigned int seen = 0, target = (unsigned int)(h->count * pct / 100.0);
+    int i;
+
+    for(i = 0; i < STATS_NB_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if(seen > target) {
+            return hist_bucket_value(i);
+        }
     }
+    return h->max;
 }
 
-/* Add or subtract samples to get a better sync, return new
-   audio buffer size */
-int synchronize_audio(VideoState *is, short *samples, int samples_size, double pts) {
-    int n;
-    double ref_clock;
+/* Return a scaler context for the given conversion, reusing a cached one
+   when possible and evicting the least recently used otherwise. */
+struct SwsContext *sws_cache_get(SwsCache *c, int src_w, int src_h, int src_fmt,
+                                 int dst_w, int dst_h, int dst_fmt, int flags) {
+    SwsCacheEntry *e, *victim = &c->entries[0];
+    int i;
 
-    n = 2 * is->audio_st->codec->channels;
+    for(i = 0; i < SWS_CACHE_SIZE; i++) {
+        e = &c->entries[i];
+        if(e->ctx && e->src_w == src_w && e->src_h == src_h && e->src_fmt == src_fmt &&
+           e->dst_w == dst_w && e->dst_h == dst_h && e->dst_fmt == dst_fmt &&
+           e->flags == flags) {
+            e->last_used = ++c->clock;
+            return e->ctx;
+        }
+        if(!e->ctx || (victim->ctx && e->last_used < victim->last_used)) {
+            victim = e;
+        }
+    }
 
-    if(is->av_sync_type != AV_SYNC_AUDIO_MASTER) {
-        double diff, avg_diff;
-        int wanted_size, min_size, max_size, nb_samples;
+    if(victim->ctx) {
+        sws_freeContext(victim->ctx);
+    }
+    victim->ctx = sws_getContext(src_w, src_h, (PixelFormat)src_fmt,
+                                 dst_w, dst_h, (PixelFormat)dst_fmt,
+                                 flags, NULL, NULL, NULL);
+    victim->src_w = src_w;
+    victim->src_h = src_h;
+    victim->src_fmt = src_fmt;
+    victim->dst_w = dst_w;
+    victim->dst_h = dst_h;
+    victim->dst_fmt = dst_fmt;
+    victim->flags = flags;
+    victim->last_used = ++c->clock;
+    return victim->ctx;
+}
 
-        ref_clock = get_master_clock(is);
-        diff = get_audio_clock(is) - ref_clock;
+void sws_cache_free(SwsCache *c) {
+    int i;
 
-        if(diff < AV_NOSYNC_THRESHOLD) {
-            // accumulate the diffs
-            is->audio_diff_cum = diff + is->audio_diff_avg_coef
-                                 * is->audio_diff_cum;
-            if(is->audio_diff_avg_count < AUDIO_DIFF_AVG_NB) {
-                is->audio_diff_avg_count++;
-            } else {
-                avg_diff = is->audio_diff_cum * (1.0 - is->audio_diff_avg_coef);
-                if(fabs(avg_diff) >= is->audio_diff_threshold) {
-                    wanted_size = samples_size + ((int)(diff * is->audio_st->codec->sample_rate) * n);
-                    min_size = samples_size * ((100 - SAMPLE_CORRECTION_PERCENT_MAX) / 100);
-                    max_size = samples_size * ((100 + SAMPLE_CORRECTION_PERCENT_MAX) / 100);
-                    if(wanted_size < min_size) {
-                        wanted_size = min_size;
-                    } else if (wanted_size > max_size) {
-                        wanted_size = max_size;
-                    }
-                    if(wanted_size < samples_size) {
-                        /* remove samples */
-                        samples_size = wanted_size;
-                    } else if(wanted_size > samples_size) {
-                        uint8_t *samples_end, *q;
-                        int nb;
-
-                        /* add samples by copying final sample*/
-                        nb = (samples_size - wanted_size);
-                        samples_end = (uint8_t *)samples + samples_size - n;
-                        q = samples_end + n;
-                        while(nb > 0) {
-                            memcpy(q, samples_end, n);
-                            q += n;
-                            nb -= n;
-                        }
-                        samples_size = wanted_size;
-                    }
-                }
-            }
-        } else {
-            /* difference is TOO big; reset diff stuff */
-            is->audio_diff_avg_count = 0;
-            is->audio_diff_cum = 0;
+    for(i = 0; i < SWS_CACHE_SIZE; i++) {
+        if(c->entries[i].ctx) {
+            sws_freeContext(c->entries[i].ctx);
         }
     }
-    return samples_size;
+    memset(c, 0, sizeof(*c));
 }
 
-void audio_callback(void *userdata, Uint8 *stream, int len) {
-
-    VideoState *is = (VideoState *)userdata;
-    int len1, audio_size;
-    double pts;
+/* Take a task of priority 'prio', from the bottom of the own deque or
+   else the top of the next worker's along that has one. */
+static int executor_take(Executor *e, ExecWorker *w, int prio, Task *t) {
+    int self = w - e->workers;
+    ExecWorker *v;
+    TaskDeque *d;
+    int i;
 
-    while(len > 0) {
-        if(is->audio_buf_index >= is->audio_buf_size) {
-            /* We have already sent all our data; get more */
-            audio_size = audio_decode_frame(is, is->audio_buf, sizeof(is->audio_buf), &pts);
-            if(audio_size < 0) {
-                /* If error, output silence */
-                is->audio_buf_size = 1024;
-                memset(is->audio_buf, 0, is->audio_buf_size);
+    for(i = 0; i < e->nb_workers; i++) {
+        v = &e->workers[(self + i) % e->nb_workers];
+        d = &v->deques[prio];
+        if(d->top == d->bottom) {
+            continue;
+        }
+        SDL_LockMutex(v->mutex);
+        if(d->top != d->bottom) {
+            if(v == w) {
+                *t = d->tasks[--d->bottom & (EXEC_DEQUE_SIZE - 1)];
             } else {
-                if(is->av_sync_type != AV_SYNC_AUDIO_MASTER) {
-                    audio_size = synchronize_audio(is, (int16_t *)is->audio_buf,
-                                                   audio_size, pts);
-                }
-                is->audio_buf_size = audio_size;
+                *t = d->tasks[d->top++ & (EXEC_DEQUE_SIZE - 1)];
+                __sync_fetch_and_add(&e->stolen, 1);
             }
-            is->audio_buf_index = 0;
+            SDL_UnlockMutex(v->mutex);
+            __sync_fetch_and_sub(&e->nb_queued, 1);
+            return 1;
         }
-        len1 = is->audio_buf_size - is->audio_buf_index;
-        if(len1 > len)
-            len1 = len;
-        memcpy(stream, (uint8_t *)is->audio_buf + is->audio_buf_index, len1);
-        len -= len1;
-        stream += len1;
-        is->audio_buf_index += len1;
+        SDL_UnlockMutex(v->mutex);
     }
+    return 0;
 }
 
-int queue_picture(VideoState *is, AVFrame *pFrame, double pts) {
+static int executor_worker_thread(void *arg) {
+    ExecWorker *w = (ExecWorker *)arg;
+    Executor *e = w->exec;
+    /* background tasks never take the last worker, a lone one runs none */
+    int max_background = e->nb_workers - 1;
+    Task t;
+    int prio;
+    unsigned int wakeups;
+
+    while(!e->quit) {
+        /* read before looking for work: whatever is queued or freed after
+           this changes it, so the worker doesn't sleep through it */
+        wakeups = e->wakeups;
+        __sync_synchronize();
+        for(prio = 0; prio < TASK_PRIO_NB; prio++) {
+            if(prio == TASK_PRIO_BACKGROUND &&
+               __sync_add_and_fetch(&e->nb_background, 1) > max_background) {
+                /* keep a worker free for the tasks somebody waits for */
+                __sync_fetch_and_sub(&e->nb_background, 1);
+                prio = TASK_PRIO_NB;
+                break;
+            }
+            if(executor_take(e, w, prio, &t)) {
+                break;
+            }
+            if(prio == TASK_PRIO_BACKGROUND) {
+                __sync_fetch_and_sub(&e->nb_background, 1);
+            }
+        }
+        if(prio < TASK_PRIO_NB) {
+            t.run(t.opaque, w);
+            __sync_fetch_and_add(&e->executed, 1);
+            if(prio == TASK_PRIO_BACKGROUND) {
+                /* a worker is free for background tasks again, wake one
+                   that may have left some queued */
+                SDL_LockMutex(e->mutex);
+                __sync_fetch_and_sub(&e->nb_background, 1);
+                e->wakeups++;
+                if(e->nb_queued > 0) {
+                    SDL_CondSignal(e->cond);
+                }
+                SDL_UnlockMutex(e->mutex);
+            }
+            continue;
+        }
+        SDL_LockMutex(e->mutex);
+        if(!e->quit && e->wakeups == wakeups) {
+            SDL_CondWait(e->cond, e->mutex);
+        }
+        SDL_UnlockMutex(e->mutex);
+    }
+    return 0;
+}
 
-    VideoPicture *vp;
-    int dst_pix_fmt;
-    AVPicture pict;
-    static struct SwsContext *img_convert_ctx;
+Executor *executor_create(int nb_threads) {
+    Executor *e;
+    int i;
 
-    /* wait until we have space for a new pic */
-    SDL_LockMutex(is->pictq_mutex);
-    while(is->pictq_size >= VIDEO_PICTURE_QUEUE_SIZE &&
-          !is->quit) {
+    e = (Executor *)av_mallocz(sizeof(Executor));
+    if(!e) {
+        return NULL;
+    }
+    e->nb_workers = av_clip(nb_threads, 1, EXEC_THREADS_MAX);
+    e->mutex = SDL_CreateMutex();
+    e->cond = SDL_CreateCond();
+    for(i = 0; i < e->nb_workers; i++) {
+        e->workers[i].exec = e;
+        e->workers[i].mutex = SDL_CreateMutex();
+    }
+    for(i = 0; i < e->nb_workers; i++) {
+        e->workers[i].tid = SDL_CreateThread(executor_worker_thread, &e->workers[i]);
+    }
+    return e;
+}
 
-        SDL_CondWait(is->pictq_cond, is->pictq_mutex);
+/* Stop the workers, tasks still queued are dropped. */
+void executor_free(Executor *e) {
+    int i;
 
+    SDL_LockMutex(e->mutex);
+    e->quit = 1;
+    SDL_CondBroadcast(e->cond);
+    SDL_UnlockMutex(e->mutex);
+    for(i = 0; i < e->nb_workers; i++) {
+        if(e->workers[i].tid) {
+            SDL_WaitThread(e->workers[i].tid, NULL);
+        }
+        sws_cache_free(&e->workers[i].sws_cache);
+        SDL_DestroyMutex(e->workers[i].mutex);
     }
+    SDL_DestroyCond(e->cond);
+    SDL_DestroyMutex(e->mutex);
+    av_free(e);
+}
 
-    SDL_UnlockMutex(is->pictq_mutex);
-
-    if(is->quit)
-        return -1;
+/* Queue a task on the next worker in turn that has fewer than 'limit'
+   tasks of that priority queued. Returns -1 if none has. */
+static int executor_push(Executor *e, int prio, void (*run)(void *, ExecWorker *), void *opaque,
+                         unsigned int limit) {
+    unsigned int first = __sync_fetch_and_add(&e->next_worker, 1);
+    ExecWorker *w;
+    TaskDeque *d;
+    int i;
 
-    // windex is set to 0 initially
-    vp = &is->pictq[is->pictq_windex];
+    for(i = 0; i < e->nb_workers; i++) {
+        w = &e->workers[(first + i) % e->nb_workers];
+        d = &w->deques[prio];
+        SDL_LockMutex(w->mutex);
+        if(d->bottom - d->top < limit) {
+            d->tasks[d->bottom & (EXEC_DEQUE_SIZE - 1)].run = run;
+            d->tasks[d->bottom & (EXEC_DEQUE_SIZE - 1)].opaque = opaque;
+            d->bottom++;
+            SDL_UnlockMutex(w->mutex);
+
+            SDL_LockMutex(e->mutex);
+            __sync_fetch_and_add(&e->nb_queued, 1);
+            e->wakeups++;
+            SDL_CondSignal(e->cond);
+            SDL_UnlockMutex(e->mutex);
+            return 0;
+        }
+        SDL_UnlockMutex(w->mutex);
+    }
+    return -1;
+}
 
-    /* allocate or resize the buffer! */
-    if(!vp->bmp ||
-       vp->width != is->video_st->codec->width ||
-       vp->height != is->video_st->codec->height) {
+/* Queue a task. Returns -1 if the deques are full, the caller then runs
+   the task itself or drops it. The last EXEC_DEQUE_RESERVE slots are left
+   to the stages, which can't be dropped. */
+int executor_submit(Executor *e, int prio, void (*run)(void *, ExecWorker *), void *opaque) {
+    return executor_push(e, prio, run, opaque, EXEC_DEQUE_SIZE - EXEC_DEQUE_RESERVE);
+}
 
-        SDL_Event event;
+/* executor priority of the session's tasks, the one in focus goes first */
+static int stream_priority(VideoState *is) {
+    return is->index == is->player->focus ? TASK_PRIO_FOCUS : TASK_PRIO_NORMAL;
+}
 
-        vp->allocated = 0;
-        /* we have to do it in the main thread */
-        event.type = FF_ALLOC_EVENT;
-        event.user.data1 = is;
-        SDL_PushEvent(&event);
 
-        /* wait until we have a picture allocated */
-        SDL_LockMutex(is->pictq_mutex);
-        while(!vp->allocated && !is->quit) {
+static void stage_run(void *opaque, ExecWorker *w);
 
-            SDL_CondWait(is->pictq_cond, is->pictq_mutex);
+/* Queue the stage unless its task is queued already; a running stage steps
+   again instead of parking. Callable from any thread but the audio
+   callback's, and for a stage that did not start or ended already. */
+void stage_wake(Stage *s) {
+    int state, ret;
 
+    /* whatever the caller changed before the state, the stage sets its
+       state before looking, so either it sees the change or we see it run */
+    __sync_synchronize();
+    for(;;) {
+        state = s->state;
+        if(state == STAGE_IDLE) {
+            if(__sync_bool_compare_and_swap(&s->state, STAGE_IDLE, STAGE_QUEUED)) {
+                /* each session has few stages, the reserve always has room */
+                ret = executor_push(s->exec, stream_priority(s->is), stage_run, s, EXEC_DEQUE_SIZE);
+                av_assert0(ret >= 0);
+                return;
+            }
+        } else if(state == STAGE_RUNNING) {
+            if(__sync_bool_compare_and_swap(&s->state, STAGE_RUNNING, STAGE_RERUN)) {
+                return;
+            }
+        } else {
+            /* queued, told to step again already, or not running at all */
+            return;
         }
+    }
+}
 
-        SDL_UnlockMutex(is->pictq_mutex);
-        if(is->quit) {
-            return -1;
+/* Run 'step' as a stage of 'is' from now on. */
+void stage_start(Stage *s, Executor *exec, VideoState *is, int (*step)(VideoState *is)) {
+    s->exec = exec;
+    s->is = is;
+    s->step = step;
+    __sync_synchronize();
+    s->state = STAGE_IDLE;
+    stage_wake(s);
+}
+
+/* Executor task: step the stage until it parks or ends, or for STAGE_STEPS
+   steps, after which it goes to the back of the queue so that the other
+   sessions get their turn and a change of focus takes effect. */
+static void stage_run(void *opaque, ExecWorker *w) {
+    Stage *s = (Stage *)opaque;
+    int n, ret;
+
+    for(n = 0; ; n++) {
+        s->state = STAGE_RUNNING;
+        /* the state before whatever the step looks at, see stage_wake */
+        __sync_synchronize();
+        switch(s->step(s->is)) {
+        case STEP_DONE:
+            s->state = STAGE_STOPPED;
+            return;
+        case STEP_PARKED:
+            if(__sync_bool_compare_and_swap(&s->state, STAGE_RUNNING, STAGE_IDLE)) {
+                return;
+            }
+            /* woken since it looked, step again */
+            break;
+        default:
+            break;
+        }
+        if(n + 1 >= STAGE_STEPS) {
+            s->state = STAGE_QUEUED;
+            ret = executor_push(s->exec, stream_priority(s->is), stage_run, s, EXEC_DEQUE_SIZE);
+            av_assert0(ret >= 0);
+            return;
         }
     }
-    /* We have a place to put our picture on the queue */
-    /* If we are skipping a frame, do we set this to null
-     but still return vp->allocated = 1? */
+}
 
-    if(vp->bmp) {
+void packet_pool_init(PacketPool *pool, int max_kb) {
+    memset(pool, 0, sizeof(*pool));
+    pool->mutex = SDL_CreateMutex();
+    pool->max_bytes = (int64_t)max_kb * 1024;
+}
 
-        SDL_LockYUVOverlay(vp->bmp);
-        dst_pix_fmt = PIX_FMT_YUV420P;
-        /* point pict at the queue */
+/* Free buffers of other classes, largest first, until 'need' more bytes fit
+   under the cap. Called with the mutex held. */
+static int packet_pool_reclaim(PacketPool *pool, int64_t need) {
+    PoolBuffer *b;
+    int cls;
+
+    for(cls = POOL_NB_CLASSES - 1; cls >= 0; cls--) {
+        while(pool->bytes + need > pool->max_bytes && (b = pool->free_list[cls])) {
+            pool->free_list[cls] = b->next;
+            pool->bytes -= POOL_HEADER_SIZE + (1 << (cls + POOL_MIN_SHIFT));
+            av_free(b);
+        }
+    }
+    return pool->bytes + need <= pool->max_bytes ? 0 : -1;
+}
 
-        pict.data[0] = vp->bmp->pixels[0];
-        pict.data[1] = vp->bmp->pixels[2];
-        pict.data[2] = vp->bmp->pixels[1];
+/* A buffer of at least 'size' bytes, NULL if too big or over the cap. */
+static uint8_t *packet_pool_get(PacketPool *pool, int size) {
+    PoolBuffer *b;
+    int cls = 0, bytes;
 
-        pict.linesize[0] = vp->bmp->pitches[0];
-        pict.linesize[1] = vp->bmp->pitches[2];
-        pict.linesize[2] = vp->bmp->pitches[1];
+    while(cls < POOL_NB_CLASSES && (1 << (cls + POOL_MIN_SHIFT)) < size) {
+        cls++;
+    }
+    if(cls == POOL_NB_CLASSES) {
+        return NULL;
+    }
+    bytes = POOL_HEADER_SIZE + (1 << (cls + POOL_MIN_SHIFT));
+
+    SDL_LockMutex(pool->mutex);
+    if((b = pool->free_list[cls])) {
+        pool->free_list[cls] = b->next;
+        pool->hits++;
+    } else if(packet_pool_reclaim(pool, bytes) < 0 ||
+              !(b = (PoolBuffer *)av_malloc(bytes))) {
+        pool->capped++;
+        SDL_UnlockMutex(pool->mutex);
+        return NULL;
+    } else {
+        b->pool = pool;
+        b->cls = cls;
+        pool->bytes += bytes;
+        pool->peak_bytes = FFMAX(pool->peak_bytes, pool->bytes);
+        pool->misses++;
+    }
+    SDL_UnlockMutex(pool->mutex);
+    return (uint8_t *)b + POOL_HEADER_SIZE;
+}
 
-        // Convert the image into YUV format that SDL uses
-        if(img_convert_ctx == NULL) {
-            int w = is->video_st->codec->width;
-            int h = is->video_st->codec->height;
-            img_convert_ctx = sws_getContext(w, h,
-                                             is->video_st->codec->pix_fmt, w, h,
-                                             (PixelFormat)dst_pix_fmt, SWS_BICUBIC, NULL, NULL, NULL);
-            if(img_convert_ctx == NULL) {
-                fprintf(stderr, "Cannot initialize the conversion context!\n");
-                exit(1);
-            }
-        }
-        sws_scale(img_convert_ctx, pFrame->data, pFrame->linesize,
-                  0, is->video_st->codec->height, pict.data, pict.linesize);
+/* AVPacket destruct of pooled payloads: back to the free list */
+static void packet_pool_destruct(AVPacket *pkt) {
+    PoolBuffer *b = (PoolBuffer *)(pkt->data - POOL_HEADER_SIZE);
+    PacketPool *pool = b->pool;
+
+    SDL_LockMutex(pool->mutex);
+    b->next = pool->free_list[b->cls];
+    pool->free_list[b->cls] = b;
+    SDL_UnlockMutex(pool->mutex);
+    pkt->data = NULL;
+    pkt->size = 0;
+}
 
-        SDL_UnlockYUVOverlay(vp->bmp);
-        vp->pts = pts;
+/* av_dup_packet into a pooled buffer, -1 if the pool can't take it */
+static int packet_pool_dup(PacketPool *pool, AVPacket *pkt) {
+    uint8_t *data = packet_pool_get(pool, pkt->size + FF_INPUT_BUFFER_PADDING_SIZE);
 
-        /* now we inform our display thread that we have a pic ready */
-        if(++is->pictq_windex == VIDEO_PICTURE_QUEUE_SIZE) {
+    if(!data) {
+        return -1;
+    }
+    memcpy(data, pkt->data, pkt->size);
+    memset(data + pkt->size, 0, FF_INPUT_BUFFER_PADDING_SIZE);
+    pkt->data = data;
+    pkt->destruct = packet_pool_destruct;
+    return 0;
+}
 
-            is->pictq_windex = 0;
+/* Free the pool once every packet taken from it was freed. */
+void packet_pool_free(PacketPool *pool) {
+    PoolBuffer *b;
+    int cls;
 
+    for(cls = 0; cls < POOL_NB_CLASSES; cls++) {
+        while((b = pool->free_list[cls])) {
+            pool->free_list[cls] = b->next;
+            av_free(b);
         }
-
-        SDL_LockMutex(is->pictq_mutex);
-        is->pictq_size++;
-        SDL_UnlockMutex(is->pictq_mutex);
     }
+    SDL_DestroyMutex(pool->mutex);
+}
 
-    return 0;
+/* A queue from the 'producer' stage to the 'consumer' one. */
+void packet_queue_init(PacketQueue *q, AVRational time_base, PacketPool *pool,
+                       Stage *producer, Stage *consumer) {
+    memset(q, 0, sizeof(PacketQueue));
+    q->time_base = time_base;
+    q->pool = pool;
+    q->max_size = INT_MAX;
+    q->min_size = INT_MAX;
+    q->producer = producer;
+    q->consumer = consumer;
 }
 
-double synchronize_video(VideoState *is, AVFrame *src_frame, double pts) {
+/* durations are in milliseconds, 0 disables the duration limit */
+void packet_queue_set_limits(PacketQueue *q, int max_size, int min_size,
+                             int max_duration, int min_duration) {
+    q->cap_size = q->max_size = max_size;
+    q->cap_min_size = q->min_size = FFMIN(min_size, max_size);
+    q->max_duration = max_duration * 1000;
+    q->min_duration = FFMIN(min_duration, max_duration) * 1000;
+}
 
-    double frame_delay;
+/* Limit the queue to 'budget' bytes, or its configured cap if lower. The
+   low-water mark keeps its distance below the high one. */
+static void packet_queue_set_budget(PacketQueue *q, int64_t budget) {
+    int max_size = (int)FFMIN(q->cap_size, budget);
 
-    if(pts != 0) {
-        /* if we have pts, set video clock to it */
-        is->video_clock = pts;
-    } else {
-        /* if we aren't given a pts, set it to the clock */
-        pts = is->video_clock;
-    }
-    /* update the video clock */
-    frame_delay = av_q2d(is->video_st->codec->time_base);
-    /* if we are repeating a frame, adjust clock accordingly */
-    frame_delay += src_frame->repeat_pict * (frame_delay * 0.5);
-    is->video_clock += frame_delay;
-    return pts;
+    q->min_size = q->cap_size > 0 ? (int)((int64_t)q->cap_min_size * max_size / q->cap_size) : 0;
+    q->max_size = max_size;
 }
 
-int video_thread(void *arg) {
-    VideoState *is = (VideoState *)arg;
-    AVPacket pkt1, *packet = &pkt1;
-    int len1, frameFinished;
-    AVFrame *pFrame;
-    double pts;
+static int packet_duration(PacketQueue *q, AVPacket *pkt) {
+    return (int)(pkt->duration * av_q2d(q->time_base) * 1000000.0);
+}
 
-    pFrame = avcodec_alloc_frame();
+/* over the high-water mark, demux should stop feeding this queue */
+int packet_queue_full(PacketQueue *q) {
+    return q->size > q->max_size ||
+           (q->max_duration && q->duration > q->max_duration);
+}
 
-    for(;;) {
-        if(packet_queue_get(&is->videoq, packet, 1) < 0) {
-            // means we quit getting packets
-            break;
-        }
-        pts = 0;
-
-        // Save global pts to be stored in pFrame in first call
-        global_video_pkt_pts = packet->pts;
-        // Decode video frame
-        len1 = avcodec_decode_video(is->video_st->codec, pFrame, &frameFinished,
-                                    packet->data, packet->size);
-        //len1 = avcodec_decode_video2(is->video_st->codec, pFrame, &frameFinished, packet);
-        if(packet->dts == AV_NOPTS_VALUE
-           && pFrame->opaque && *(uint64_t*)pFrame->opaque != AV_NOPTS_VALUE) {
-            pts = *(uint64_t *)pFrame->opaque;
-        } else if(packet->dts != AV_NOPTS_VALUE) {
-            pts = packet->dts;
-        } else {
-            pts = 0;
-        }
-        pts *= av_q2d(is->video_st->time_base);
+/* back under the low-water mark, demux can resume */
+static int packet_queue_drained(PacketQueue *q) {
+    return q->size <= q->min_size &&
+           (!q->max_duration || q->duration <= q->min_duration);
+}
 
-        // Did we get a video frame?
-        if(frameFinished) {
-            pts = synchronize_video(is, pFrame, pts);
-            if(queue_picture(is, pFrame, pts) < 0) {
-                break;
-            }
-        }
-        av_free_packet(packet);
+static int packet_queue_ready(PacketQueue *q, int what) {
+    unsigned int used = q->windex - q->rindex;
+
+    switch(what) {
+    case PACKET_QUEUE_WAIT_DATA:
+        return used > 0;
+    case PACKET_QUEUE_WAIT_SLOT:
+        return used < PACKET_QUEUE_SIZE;
+    default:
+        return packet_queue_drained(q);
     }
-    av_free(pFrame);
-    return 0;
 }
 
-int our_get_buffer(struct AVCodecContext *c, AVFrame *pic) {
-    int ret = avcodec_default_get_buffer(c, pic);
-    uint64_t *pts = (uint64_t *) av_malloc(sizeof(uint64_t));
-    *pts = global_video_pkt_pts;
-    pic->opaque = pts;
-    return ret;
+/* Park the calling stage until the ring has data/space, it then returns
+   STEP_PARKED. Returns 1 if that is there already, or the queue aborted,
+   and the stage should just go on. Each side publishes what it waits for
+   in its own field before re-checking the ring, and the other side
+   publishes its index before reading that field, so (with the full
+   barriers) one of the two always sees the other. Only the consumer waits
+   for data. */
+static int packet_queue_park(PacketQueue *q, int what) {
+    volatile int *waiting = what == PACKET_QUEUE_WAIT_DATA ? &q->consumer_waiting
+                                                          : &q->producer_waiting;
+
+    *waiting = what;
+    __sync_synchronize();
+    if(packet_queue_ready(q, what) || q->abort_request) {
+        /* if the other side took it meanwhile, the stage just steps once more */
+        __sync_bool_compare_and_swap(waiting, what, PACKET_QUEUE_WAIT_NONE);
+        return 1;
+    }
+    return 0;
 }
 
-void our_release_buffer(struct AVCodecContext *c, AVFrame *pic) {
-    if(pic) av_freep(&pic->opaque);
-    avcodec_default_release_buffer(c, pic);
+/* Wake either side if it is parked on something that is now available.
+   Taking the field back to NONE makes sure it is woken once. */
+static void packet_queue_wake(PacketQueue *q) {
+    int producer, consumer;
+
+    __sync_synchronize();
+    producer = q->producer_waiting;
+    consumer = q->consumer_waiting;
+    if(producer != PACKET_QUEUE_WAIT_NONE && packet_queue_ready(q, producer) &&
+       __sync_bool_compare_and_swap(&q->producer_waiting, producer, PACKET_QUEUE_WAIT_NONE)) {
+        stage_wake(q->producer);
+    }
+    if(consumer != PACKET_QUEUE_WAIT_NONE && packet_queue_ready(q, consumer) &&
+       __sync_bool_compare_and_swap(&q->consumer_waiting, consumer, PACKET_QUEUE_WAIT_NONE)) {
+        stage_wake(q->consumer);
+    }
 }
 
-int stream_component_open(VideoState *is, int stream_index) {
+/* Never waits: the producer makes sure there is a free slot first, see
+   packet_queue_park. */
+int packet_queue_put(PacketQueue *q, AVPacket *pkt) {
 
-    AVFormatContext *pFormatCtx = is->pFormatCtx;
-    AVCodecContext *codecCtx;
-    AVCodec *codec;
-    SDL_AudioSpec wanted_spec, spec;
+    unsigned int windex;
 
-    if(stream_index < 0 || stream_index >= pFormatCtx->nb_streams) {
+    windex = q->windex;
+    if(windex - q->rindex >= PACKET_QUEUE_SIZE) {
+        av_free_packet(pkt);
         return -1;
     }
-
-    // Get a pointer to the codec context for the video stream
-    codecCtx = pFormatCtx->streams[stream_index]->codec;
-
-    if(codecCtx->codec_type == CODEC_TYPE_AUDIO) {
-        // Set audio settings from codec info
-        wanted_spec.freq = codecCtx->sample_rate;
-        wanted_spec.format = AUDIO_S16SYS;
-        wanted_spec.channels = codecCtx->channels;
-        wanted_spec.silence = 0;
-        wanted_spec.samples = SDL_AUDIO_BUFFER_SIZE;
-        wanted_spec.callback = audio_callback;
-        wanted_spec.userdata = is;
-
-        if(SDL_OpenAudio(&wanted_spec, &spec) < 0) {
-            fprintf(stderr, "SDL_OpenAudio: %s\n", SDL_GetError());
+    /* a packet without data is the end of stream marker */
+    if(pkt->data && pkt->data != flush_pkt.data) {
+        if(!pkt->destruct) {
+            /* points into the demuxer, needs a copy of its own */
+            q->copies++;
+            q->bytes_copied += pkt->size;
+        }
+        if((pkt->destruct || !q->pool || packet_pool_dup(q->pool, pkt) < 0) &&
+           av_dup_packet(pkt) < 0) {
             return -1;
         }
-        //is->audio_hw_buf_size = spec.size; //pare che nn serve
-    }
-    codec = avcodec_find_decoder(codecCtx->codec_id);
-
-    if(!codec || (avcodec_open(codecCtx, codec) < 0)) {
-        fprintf(stderr, "Unsupported codec!\n");
-        return -1;
     }
+    q->pkts[windex & (PACKET_QUEUE_SIZE - 1)] = *pkt;
+    /* the slot must be visible before the consumer can see the new windex */
+    __sync_synchronize();
+    q->windex = windex + 1;
+    __sync_add_and_fetch(&q->nb_packets, 1);
+    __sync_add_and_fetch(&q->size, pkt->size);
+    __sync_add_and_fetch(&q->duration, packet_duration(q, pkt));
+
+    packet_queue_wake(q);
+    return 0;
+}
 
-    switch(codecCtx->codec_type) {
-
-    case CODEC_TYPE_AUDIO:
-        is->audioStream = stream_index;
-        is->audio_st = pFormatCtx->streams[stream_index];
-        is->audio_buf_size = 0;
-        is->audio_buf_index = 0;
-        memset(&is->audio_pkt, 0, sizeof(is->audio_pkt));
-        packet_queue_init(&is->audioq);
-        SDL_PauseAudio(0);
-        break;
+/* Queue the end of stream marker, waking the consumer so that it can drain
+   its decoder. */
+int packet_queue_put_eof(PacketQueue *q, int stream_index) {
+    AVPacket pkt;
 
-    case CODEC_TYPE_VIDEO:
-        is->videoStream = stream_index;
-        is->video_st = pFormatCtx->streams[stream_index];
+    av_init_packet(&pkt);
+    pkt.data = NULL;
+    pkt.size = 0;
+    pkt.stream_index = stream_index;
+    return packet_queue_put(q, &pkt);
+}
 
-        is->frame_timer = (double)av_gettime() / 1000000.0;
-        is->frame_last_delay = 40e-3;
-        is->video_current_pts_time = av_gettime();
+/* Drop everything queued so far. The consumer discards packets up to the
+   flush marker, which carries the seek target in AV_TIME_BASE as pts, and
+   then gets the marker so it can reset its codec. */
+int packet_queue_flush(PacketQueue *q, int64_t target) {
+    AVPacket pkt = flush_pkt;
 
-        packet_queue_init(&is->videoq);
-        is->video_tid = SDL_CreateThread(video_thread, is);
-        codecCtx->get_buffer = our_get_buffer;
-        codecCtx->release_buffer = our_release_buffer;
-        break;
+    pkt.pts = target;
+    __sync_add_and_fetch(&q->serial, 1);
+    return packet_queue_put(q, &pkt);
+}
 
-    default:
-        break;
+/* Share the memory budget between the open queues of all sessions, in
+   proportion to their bit rates, and apply it. Called each time a queue
+   opens; queues of other sessions change their limits under them, which
+   their producer picks up on the next packet. */
+static void player_split_budget(Player *pl) {
+    PacketQueue *queues[MAX_SESSIONS * 2];
+    int64_t total_rate = 0;
+    int i, n = 0;
+
+    if(!pl->mem_budget) {
+        return;
     }
-
+    SDL_LockMutex(pl->budget_mutex);
+    for(i = 0; i < pl->nb_sessions; i++) {
+        if(pl->sessions[i]->audioq.bit_rate) {
+            queues[n++] = &pl->sessions[i]->audioq;
+        }
+        if(pl->sessions[i]->videoq.bit_rate) {
+            queues[n++] = &pl->sessions[i]->videoq;
+        }
+    }
+    for(i = 0; i < n; i++) {
+        total_rate += queues[i]->bit_rate;
+    }
+    for(i = 0; i < n; i++) {
+        packet_queue_set_budget(queues[i], FFMAX(pl->mem_budget * queues[i]->bit_rate / total_rate,
+                                                 QUEUE_MIN_BUDGET));
+    }
+    SDL_UnlockMutex(pl->budget_mutex);
 }
 
-int decode_interrupt_cb(void) {
-    return (global_video_state && global_video_state->quit);
+/* expected bit rate of a stream, for its share of the memory budget */
+static int stream_bit_rate(AVFormatContext *ic, AVCodecContext *codecCtx) {
+    if(codecCtx->bit_rate > 0) {
+        return codecCtx->bit_rate;
+    }
+    if(codecCtx->codec_type == AVMEDIA_TYPE_VIDEO) {
+        /* most of the container's, if it knows that */
+        return ic->bit_rate > 0 ? ic->bit_rate : VIDEO_BIT_RATE_GUESS;
+    }
+    return AUDIO_BIT_RATE_GUESS;
 }
 
-int decode_thread(void *arg) {
-
-    VideoState *is = (VideoState *)arg;
-    AVFormatContext *pFormatCtx;
-    AVPacket pkt1, *packet = &pkt1;
-    SDL_Surface     *screen;
-
-    int video_index = -1;
-    int audio_index = -1;
-    int i;
-
-    is->videoStream=-1;
-    is->audioStream=-1;
+/* tell the main thread a session has something new for it */
+static void player_wake(Player *pl) {
+    SDL_LockMutex(pl->present_mutex);
+    SDL_CondSignal(pl->present_cond);
+    SDL_UnlockMutex(pl->present_mutex);
+}
 
-    global_video_state = is;
-    // will interrupt blocking functions if we quit!
-    url_set_interrupt_cb(decode_interrupt_cb);
+/* Fail every get from now on and wake both sides, to stop both stages. */
+void packet_queue_abort(PacketQueue *q) {
+    if(!q->consumer) {
+        return;
+    }
+    q->abort_request = 1;
+    stage_wake(q->producer);
+    stage_wake(q->consumer);
+}
 
-    // Open video file
-    if(av_open_input_file(&pFormatCtx, is->filename, NULL, 0, NULL)!=0)
-        return -1; // Couldn't open file
+/* Free the packets still queued, once both stages ended. */
+void packet_queue_free(PacketQueue *q) {
+    for(; q->rindex != q->windex; q->rindex++) {
+        av_free_packet(&q->pkts[q->rindex & (PACKET_QUEUE_SIZE - 1)]);
+    }
+}
 
-    is->pFormatCtx = pFormatCtx;
+/* Returns 1 with a packet, 0 if the queue is empty (park on
+   PACKET_QUEUE_WAIT_DATA then) and -1 once it aborted. */
+static int packet_queue_get(PacketQueue *q, AVPacket *pkt) {
 
-    // Retrieve stream information
-    if(av_find_stream_info(pFormatCtx)<0)
-        return -1; // Couldn't find stream information
+    unsigned int rindex;
 
-    // Dump information about file onto standard error
-    dump_format(pFormatCtx, 0, is->filename, 0);
+    for(;;) {
 
-    // Find the first video and audio stream
+        if(q->abort_request) {
+            return -1;
+        }
 
-    for(i=0; i<pFormatCtx->nb_streams; i++) {
-        if(pFormatCtx->streams[i]->codec->codec_type==CODEC_TYPE_VIDEO &&
-           video_index < 0) {
-            video_index=i;
+        rindex = q->rindex;
+        if(q->windex == rindex) {
+            return 0;
         }
-        if(pFormatCtx->streams[i]->codec->codec_type==CODEC_TYPE_AUDIO &&
-           audio_index < 0) {
-            audio_index=i;
+        __sync_synchronize();
+        *pkt = q->pkts[rindex & (PACKET_QUEUE_SIZE - 1)];
+        __sync_sub_and_fetch(&q->nb_packets, 1);
+        __sync_sub_and_fetch(&q->size, pkt->size);
+        __sync_sub_and_fetch(&q->duration, packet_duration(q, pkt));
+        /* we are done with the slot, hand it back to the producer */
+        __sync_synchronize();
+        q->rindex = rindex + 1;
+
+        packet_queue_wake(q);
+
+        if(pkt->data == flush_pkt.data) {
+            /* of several queued flushes, only the last one is returned */
+            if(++q->consumer_serial == q->serial) {
+                return 1;
+            }
+        } else if(q->consumer_serial == q->serial) {
+            return 1;
+        } else {
+            /* queued before a flush */
+            av_free_packet(pkt);
         }
     }
+}
 
-    // Make a screen to put our video
-#ifndef __DARWIN__
-    screen = SDL_SetVideoMode(pFormatCtx->streams[video_index]->codec->width,
-                              pFormatCtx->streams[video_index]->codec->height, 0, 0);
-#else
-    screen = SDL_SetVideoMode(pFormatCtx->streams[video_index]->codec->width,
-                              pFormatCtx->streams[video_index]->codec->height, 24, 0);
-#endif
-    if(!screen) {
-        fprintf(stderr, "SDL: could not set video mode - exiting\n");
-        exit(1);
-    }
-
-    if(audio_index >= 0) {
-        stream_component_open(is, audio_index);
+int pcm_ring_init(PcmRing *r, unsigned int depth, Stage *stage) {
+    memset(r, 0, sizeof(PcmRing));
+    r->capacity = 1;
+    while(r->capacity < depth) {
+        r->capacity <<= 1;
     }
-
-    if(video_index >= 0) {
-        stream_component_open(is, video_index);
+    r->buf = (uint8_t *)av_malloc(r->capacity);
+    if(!r->buf) {
+        return -1;
     }
+    r->depth = depth;
+    r->end_pts = NAN;
+    r->stage = stage;
+    return 0;
+}
 
-    if(is->videoStream < 0 || is->audioStream < 0) {
-        fprintf(stderr, "%s: could not open codecs\n", is->filename);
-        //cerr << "could not open codecs\n " << is->filename;
-        goto fail;
-    }
+/* bytes waiting to be played */
+unsigned int pcm_ring_fill(PcmRing *r) {
+    return r->windex - r->rindex;
+}
 
-    // main decode loop
+/* Append up to 'len' bytes, as much as fits below the depth. Returns how
+   many, -1 once the ring aborted. */
+int pcm_ring_write(PcmRing *r, const uint8_t *data, int len) {
+    unsigned int windex, pos, n, space;
+    int done = 0;
 
-    for(;;) {
-        if(is->quit) {
+    if(r->abort_request) {
+        return -1;
+    }
+    while(len > 0) {
+        windex = r->windex;
+        space = r->depth - (windex - r->rindex);
+        if(space == 0) {
             break;
         }
-        // seek stuff goes here
-        if(is->audioq.size > MAX_AUDIOQ_SIZE || is->videoq.size > MAX_VIDEOQ_SIZE) {
-            SDL_Delay(10);
-            continue;
-        }
-        if(av_read_frame(is->pFormatCtx, packet) < 0) {
-            if(url_ferror(pFormatCtx->pb) == 0) {
-                SDL_Delay(100); /* no error; wait for user input */
-                continue;
-            } else {
-                break;
-            }
-        }
-        // Is this a packet from the video stream?
-        if(packet->stream_index == is->videoStream) {
-            packet_queue_put(&is->videoq, packet);
-            // Is this a packet from the audio stream?
-        } else if(packet->stream_index == is->audioStream) {
-            packet_queue_put(&is->audioq, packet);
+        n = FFMIN(space, (unsigned int)len);
+        pos = windex & (r->capacity - 1);
+        if(pos + n > r->capacity) {
+            memcpy(r->buf + pos, data, r->capacity - pos);
+            memcpy(r->buf, data + r->capacity - pos, n - (r->capacity - pos));
         } else {
-            av_free_packet(packet);
+            memcpy(r->buf + pos, data, n);
         }
+        /* data before index, the callback may read it right away */
+        __sync_synchronize();
+        r->windex = windex + n;
+        data += n;
+        len -= n;
+        done += n;
     }
-    /* all done - wait for it */
-    while(!is->quit) {
-        SDL_Delay(100);
-    }
+    return done;
+}
 
-    fail:
-    if(1){
-        SDL_Event event;
-        event.type = FF_QUIT_EVENT;
-        event.user.data1 = is;
-        SDL_PushEvent(&event);
+/* Park the producer stage until the callback made room, the stage then
+   returns STEP_PARKED. Returns 1 if there is room already or the ring
+   aborted. Same handshake as packet_queue_park. */
+static int pcm_ring_park(PcmRing *r) {
+    r->waiting = 1;
+    __sync_synchronize();
+    if(pcm_ring_fill(r) < r->depth || r->abort_request) {
+        __sync_bool_compare_and_swap(&r->waiting, 1, 0);
+        return 1;
     }
     return 0;
 }
 
-void alloc_picture(void *userdata) {
+void pcm_ring_abort(PcmRing *r) {
+    if(!r->stage) {
+        return;
+    }
+    r->abort_request = 1;
+    stage_wake(r->stage);
+}
 
-    VideoState *is = (VideoState *)userdata;
-    VideoPicture *vp;
+/* Writer: the data written so far ends at 'pts' and was played back at
+   'speed'. */
+void pcm_ring_set_pts(PcmRing *r, double pts, double speed) {
+    seqlock_write_begin(&r->pts_seq);
+    r->end_pts = pts;
+    r->end_windex = r->windex;
+    r->speed = speed;
+    seqlock_write_end(&r->pts_seq);
+}
 
-    vp = &is->pictq[is->pictq_windex];
-    if(vp->bmp) {
-        // we already have one make another, bigger/smaller
-        SDL_FreeYUVOverlay(vp->bmp);
-    }
-    // Allocate a place to put our YUV image on that screen
-    vp->bmp = SDL_CreateYUVOverlay(is->video_st->codec->width,
-                                   is->video_st->codec->height,
-                                   SDL_YV12_OVERLAY,
-                                   screen);
-    vp->width = is->video_st->codec->width;
-    vp->height = is->video_st->codec->height;
+/* pts of the byte at 'index', NAN if not known yet */
+double pcm_ring_pts(PcmRing *r, unsigned int index, int bytes_per_sec) {
+    unsigned int seq, end_windex;
+    double end_pts, speed;
+
+    do {
+        seq = seqlock_read_begin(&r->pts_seq);
+        end_pts = r->end_pts;
+        end_windex = r->end_windex;
+        speed = r->speed;
+    } while(seqlock_read_retry(&r->pts_seq, seq));
+    return end_pts - (double)(int)(end_windex - index) / bytes_per_sec * speed;
+}
 
-    SDL_LockMutex(is->pictq_mutex);
-    vp->allocated = 1;
-    SDL_CondSignal(is->pictq_cond);
-    SDL_UnlockMutex(is->pictq_mutex);
+/* Copy up to 'len' bytes out of the ring, never blocks nor takes a lock:
+   a parked producer is only flagged for pcm_ring_poll. */
+int pcm_ring_read(PcmRing *r, uint8_t *data, int len) {
+    unsigned int rindex = r->rindex, pos, n;
+
+    n = FFMIN(r->windex - rindex, (unsigned int)len);
+    __sync_synchronize();
+    pos = rindex & (r->capacity - 1);
+    if(pos + n > r->capacity) {
+        memcpy(data, r->buf + pos, r->capacity - pos);
+        memcpy(data + r->capacity - pos, r->buf, n - (r->capacity - pos));
+    } else {
+        memcpy(data, r->buf + pos, n);
+    }
+    __sync_synchronize();
+    r->rindex = rindex + n;
 
+    __sync_synchronize();
+    if(r->waiting && __sync_bool_compare_and_swap(&r->waiting, 1, 0)) {
+        r->wake_pending = 1;
+    }
+    return n;
 }
 
-static Uint32 sdl_refresh_timer_cb(Uint32 interval, void *opaque) {
-    SDL_Event event;
-    event.type = FF_REFRESH_EVENT;
-    event.user.data1 = opaque;
-    SDL_PushEvent(&event);
-    return 0; /* 0 means stop timer */
+/* Wake the producer if the callback made room for it, off the audio
+   thread. */
+void pcm_ring_poll(PcmRing *r) {
+    if(r->wake_pending && __sync_bool_compare_and_swap(&r->wake_pending, 1, 0)) {
+        stage_wake(r->stage);
+    }
 }
 
-/* schedule a video refresh in 'delay' ms */
-static void schedule_refresh(VideoState *is, int delay) {
-    SDL_AddTimer(delay, sdl_refresh_timer_cb, is);
+double get_audio_clock(VideoState *is) {
+    return clock_get(&is->audclk);
 }
 
-void video_display(VideoState *is) {
+double get_video_clock(VideoState *is) {
+    return clock_get(&is->vidclk);
+}
 
-    SDL_Rect rect;
-    VideoPicture *vp;
-    AVPicture pict;
-    float aspect_ratio;
-    int w, h, x, y;
-    int i;
+double get_external_clock(VideoState *is) {
+    return clock_get(&is->extclk);
+}
 
-    vp = &is->pictq[is->pictq_rindex];
-    if(vp->bmp) {
-        if(is->video_st->codec->sample_aspect_ratio.num == 0) {
-            aspect_ratio = 0;
+double get_master_clock(VideoState *is) {
+    if(is->av_sync_type == AV_SYNC_VIDEO_MASTER) {
+        return get_video_clock(is);
+    } else if(is->av_sync_type == AV_SYNC_AUDIO_MASTER) {
+        return get_audio_clock(is);
+    } else {
+        return get_external_clock(is);
+    }
+}
+
+/* AV_SYNC_* for a -sync value, -1 if there is none */
+static int sync_type_from_name(const char *name) {
+    if(!strcmp(name, "audio")) {
+        return AV_SYNC_AUDIO_MASTER;
+    } else if(!strcmp(name, "video")) {
+        return AV_SYNC_VIDEO_MASTER;
+    } else if(!strcmp(name, "ext")) {
+        return AV_SYNC_EXTERNAL_MASTER;
+    }
+    return -1;
+}
+
+/* Return how many samples the next frame of nb_samples should last so
+   that audio drifts back to the master clock, at most
+   SAMPLE_CORRECTION_PERCENT_MAX away from nb_samples. */
+int synchronize_audio(VideoState *is, int nb_samples) {
+    int wanted_nb_samples = nb_samples;
+    double ref_clock;
+
+    if(is->av_sync_type != AV_SYNC_AUDIO_MASTER) {
+        double diff, avg_diff;
+        int min_nb_samples, max_nb_samples;
+
+        ref_clock = get_master_clock(is);
+        diff = get_audio_clock(is) - ref_clock;
+
+        if(fabs(diff) < AV_NOSYNC_THRESHOLD) {
+            // accumulate the diffs
+            is->audio_diff_cum = diff + is->audio_diff_avg_coef
+                                 * is->audio_diff_cum;
+            if(is->audio_diff_avg_count < AUDIO_DIFF_AVG_NB) {
+                is->audio_diff_avg_count++;
+            } else {
+                avg_diff = is->audio_diff_cum * (1.0 - is->audio_diff_avg_coef);
+                if(fabs(avg_diff) >= is->audio_diff_threshold) {
+                    wanted_nb_samples = nb_samples + (int)(diff * is->audio_st->codec->sample_rate);
+                    min_nb_samples = nb_samples * (100 - SAMPLE_CORRECTION_PERCENT_MAX) / 100;
+                    max_nb_samples = nb_samples * (100 + SAMPLE_CORRECTION_PERCENT_MAX) / 100;
+                    wanted_nb_samples = av_clip(wanted_nb_samples, min_nb_samples, max_nb_samples);
+                }
+            }
         } else {
-            aspect_ratio = av_q2d(is->video_st->codec->sample_aspect_ratio) *
-                           is->video_st->codec->width / is->video_st->codec->height;
+            /* difference is TOO big; reset diff stuff */
+            is->audio_diff_avg_count = 0;
+            is->audio_diff_cum = 0;
         }
-        if(aspect_ratio <= 0.0) {
-            aspect_ratio = (float)is->video_st->codec->width /
-                           (float)is->video_st->codec->height;
+    }
+    return wanted_nb_samples;
+}
+
+/* Convert a decoded frame, whatever its sample format, layout and rate,
+   into 'out_fmt' at the device rate and layout in is->audio_buf, stretched
+   or squeezed to last wanted_nb_samples. Returns the size in bytes. */
+static int audio_convert(VideoState *is, AVFrame *frame, int wanted_nb_samples, int out_fmt) {
+    int64_t layout = frame->channel_layout;
+    int freq = is->audio_st->codec->sample_rate;
+    int out_count, out_size, len;
+    uint8_t *out[1];
+
+    if(!layout || av_get_channel_layout_nb_channels(layout) != is->audio_st->codec->channels) {
+        layout = av_get_default_channel_layout(is->audio_st->codec->channels);
+    }
+    /* (re)build the resampler only when the decoder output changes */
+    if(!is->swr_ctx || frame->format != is->audio_src_fmt ||
+       layout != is->audio_src_layout || freq != is->audio_src_freq ||
+       out_fmt != is->audio_out_fmt) {
+        swr_free(&is->swr_ctx);
+        is->swr_ctx = swr_alloc_set_opts(NULL,
+                                         is->audio_tgt_layout, (AVSampleFormat)out_fmt,
+                                         is->audio_tgt_freq,
+                                         layout, (AVSampleFormat)frame->format, freq,
+                                         0, NULL);
+        if(!is->swr_ctx || swr_init(is->swr_ctx) < 0) {
+            fprintf(stderr, "Cannot initialize the audio resampler!\n");
+            swr_free(&is->swr_ctx);
+            return -1;
         }
-        h = screen->h;
-        w = ((int)rint(h * aspect_ratio)) & -3;
-        if(w > screen->w) {
-            w = screen->w;
-            h = ((int)rint(w / aspect_ratio)) & -3;
+        is->audio_src_fmt = frame->format;
+        is->audio_src_layout = layout;
+        is->audio_src_freq = freq;
+        is->audio_out_fmt = out_fmt;
+    }
+
+    if(wanted_nb_samples != frame->nb_samples) {
+        /* spread the correction over the whole frame: swresample's
+           (SIMD) polyphase resampler shifts the rate by a fraction
+           instead of dropping or repeating samples */
+        if(swr_set_compensation(is->swr_ctx,
+                                (wanted_nb_samples - frame->nb_samples) * is->audio_tgt_freq / freq,
+                                wanted_nb_samples * is->audio_tgt_freq / freq) < 0) {
+            fprintf(stderr, "swr_set_compensation() failed\n");
+            return -1;
         }
-        x = (screen->w - w) / 2;
-        y = (screen->h - h) / 2;
+    }
 
-        rect.x = x;
-        rect.y = y;
-        rect.w = w;
-        rect.h = h;
-        SDL_DisplayYUVOverlay(vp->bmp, &rect);
+    out_count = (int64_t)wanted_nb_samples * is->audio_tgt_freq / freq + 256;
+    out_size = av_samples_get_buffer_size(NULL, is->audio_tgt_channels, out_count,
+                                          (AVSampleFormat)out_fmt, 0);
+    av_fast_malloc(&is->audio_buf, &is->audio_buf_size, out_size);
+    if(!is->audio_buf) {
+        return -1;
+    }
+    out[0] = is->audio_buf;
+    len = swr_convert(is->swr_ctx, out, out_count,
+                      (const uint8_t **)frame->extended_data, frame->nb_samples);
+    if(len < 0) {
+        return -1;
     }
+    return len * is->audio_tgt_channels * av_get_bytes_per_sample((AVSampleFormat)out_fmt);
 }
 
-void video_refresh_timer(void *userdata) {
-
-    VideoState *is = (VideoState *)userdata;
-    VideoPicture *vp;
-    double actual_delay, delay, sync_threshold, ref_clock, diff;
+int time_stretch_init(TimeStretch *ts, int sample_rate, int channels) {
+    memset(ts, 0, sizeof(TimeStretch));
+    ts->channels = channels;
+    ts->window = STRETCH_WINDOW_MS * sample_rate / 1000;
+    ts->overlap = STRETCH_OVERLAP_MS * sample_rate / 1000;
+    ts->seek = STRETCH_SEEK_MS * sample_rate / 1000;
+    ts->mid = (int16_t *)av_malloc(ts->overlap * channels * sizeof(int16_t));
+    return ts->mid ? 0 : -1;
+}
 
-    if(is->video_st) {
-        if(is->pictq_size == 0) {
-            schedule_refresh(is, 1);
-        } else {
-            vp = &is->pictq[is->pictq_rindex];
+void time_stretch_reset(TimeStretch *ts) {
+    ts->in_frames = 0;
+    ts->have_mid = 0;
+    ts->skip_frac = 0;
+}
 
-            is->video_current_pts = vp->pts;
-            is->video_current_pts_time = av_gettime();
+/* Offset into the input, below ts->seek, where the next segment starts
+   most like the end of the previous one: the highest correlation with
+   ts->mid, normalized by the energy of the candidate. */
+static int time_stretch_best_offset(TimeStretch *ts) {
+    int n = ts->overlap * ts->channels, best = 0, off, i;
+    const int16_t *in = ts->in;
+    double score, best_score = -1e300;
+    int64_t corr, norm = 0;
+
+    for(i = 0; i < n; i++) {
+        norm += in[i] * in[i];
+    }
+    for(off = 0; off < ts->seek; off++) {
+        const int16_t *cand = in + off * ts->channels;
+
+        corr = 0;
+        for(i = 0; i < n; i++) {
+            corr += ts->mid[i] * cand[i];
+        }
+        score = corr / sqrt((double)norm + 1.0);
+        if(score > best_score) {
+            best_score = score;
+            best = off;
+        }
+        /* slide the energy window by one frame */
+        for(i = 0; i < ts->channels; i++) {
+            norm += cand[n + i] * cand[n + i] - cand[i] * cand[i];
+        }
+    }
+    return best;
+}
+
+/* Feed 'nb_frames' and stretch what can be: returns the number of frames
+   left in ts->out, which have a duration of about nb_frames / speed. */
+int time_stretch_process(TimeStretch *ts, const int16_t *samples, int nb_frames, double speed) {
+    int ch = ts->channels, step = ts->window - ts->overlap;
+    int nb_out = 0, off, skip, need, i, j;
+    unsigned int size = (ts->in_frames + nb_frames) * ch * sizeof(int16_t);
+    double pos;
+    int16_t *p, *out;
+
+    if(size > ts->in_size) {
+        if(!(p = (int16_t *)av_realloc(ts->in, size))) {
+            return -1;
+        }
+        ts->in = p;
+        ts->in_size = size;
+    }
+    memcpy(ts->in + ts->in_frames * ch, samples, nb_frames * ch * sizeof(int16_t));
+    ts->in_frames += nb_frames;
+
+    /* each step outputs 'step' frames and moves speed * step into the input */
+    need = FFMAX(ts->window + ts->seek, (int)(speed * step) + 1);
+    av_fast_malloc(&ts->out, &ts->out_size,
+                   (ts->in_frames / FFMAX((int)(speed * step), 1) + 1) * step * ch * sizeof(int16_t));
+    if(!ts->out) {
+        return -1;
+    }
+    out = ts->out;
+    while(ts->in_frames >= need) {
+        if(!ts->have_mid) {
+            off = 0;
+            memcpy(out, ts->in, ts->overlap * ch * sizeof(int16_t));
+        } else {
+            off = time_stretch_best_offset(ts);
+            p = ts->in + off * ch;
+            /* linear crossfade from the previous segment into this one */
+            for(i = 0; i < ts->overlap; i++) {
+                for(j = 0; j < ch; j++) {
+                    out[i * ch + j] = (ts->mid[i * ch + j] * (ts->overlap - i) +
+                                       p[i * ch + j] * i) / ts->overlap;
+                }
+            }
+        }
+        p = ts->in + (off + ts->overlap) * ch;
+        memcpy(out + ts->overlap * ch, p, (step - ts->overlap) * ch * sizeof(int16_t));
+        memcpy(ts->mid, ts->in + (off + step) * ch, ts->overlap * ch * sizeof(int16_t));
+        ts->have_mid = 1;
+        out += step * ch;
+        nb_out += step;
+
+        pos = speed * step + ts->skip_frac;
+        skip = (int)pos;
+        ts->skip_frac = pos - skip;
+        ts->in_frames -= skip;
+        memmove(ts->in, ts->in + skip * ch, ts->in_frames * ch * sizeof(int16_t));
+    }
+    return nb_out;
+}
+
+/* A flush marker came through audioq: forget everything decoded before it. */
+static void audio_seek_reset(VideoState *is, int64_t target) {
+    avcodec_flush_buffers(is->audio_st->codec);
+    is->audio_pkt_size = 0;
+    is->audio_finished = 0;
+    is->audio_seeking = 1;
+    is->audio_seek_target = target / (double)AV_TIME_BASE;
+    is->audio_clock = is->audio_seek_target;
+    is->audio_diff_avg_count = 0;
+    is->audio_diff_cum = 0;
+    time_stretch_reset(&is->stretch);
+    if(!is->opts.headless) {
+        /* the callback is the ring's reader, keep it out while emptying it */
+        SDL_LockAudio();
+        is->audio_ring.rindex = is->audio_ring.windex;
+        pcm_ring_set_pts(&is->audio_ring, is->audio_seek_target, is->speed);
+        clock_set(&is->audclk, is->audio_seek_target);
+        SDL_UnlockAudio();
+    }
+}
+
+/* Decode the next frame into is->audio_buf as 'out_fmt'. Returns its size,
+   0 if audioq ran empty first and -1 once it aborted. */
+int audio_decode_frame(VideoState *is, double *pts_ptr, int out_fmt) {
+
+    int len1, data_size, got_frame, ret;
+    AVPacket *pkt = &is->audio_pkt;
+    AVPacket avpkt;
+    double pts;
+
+    for(;;) {
+        while(is->audio_pkt_size > 0) {
+            PROBE_START(start);
+            /* the part of the packet we haven't decoded yet */
+            avpkt = *pkt;
+            avpkt.data = is->audio_pkt_data;
+            avpkt.size = is->audio_pkt_size;
+            avcodec_get_frame_defaults(is->audio_frame);
+            len1 = avcodec_decode_audio4(is->audio_st->codec, is->audio_frame,
+                                         &got_frame, &avpkt);
+
+            if(len1 < 0) {
+                /* if error, skip frame */
+                is->audio_pkt_size = 0;
+                break;
+            }
+            is->audio_pkt_data += len1;
+            is->audio_pkt_size -= len1;
+            if(!got_frame) {
+                /* No data yet, get more frames */
+                continue;
+            }
+            if(is->audio_seeking) {
+                /* decoding forward to the seek target */
+                double end = is->audio_clock + (double)is->audio_frame->nb_samples /
+                                               is->audio_st->codec->sample_rate;
+                if(end < is->audio_seek_target) {
+                    is->audio_clock = end;
+                    continue;
+                }
+                is->audio_seeking = 0;
+            }
+            data_size = audio_convert(is, is->audio_frame,
+                                      synchronize_audio(is, is->audio_frame->nb_samples),
+                                      out_fmt);
+            if(data_size <= 0) {
+                continue;
+            }
+            PROBE_END(is, PROBE_AUDIO_DECODE, start);
+            is->probes.audio_frames++;
+            pts = is->audio_clock;
+            *pts_ptr = pts;
+            is->audio_clock += (double)is->audio_frame->nb_samples /
+                               is->audio_st->codec->sample_rate;
+
+            /* We have data, return it and come back for more later */
+            return data_size;
+        }
+        if(pkt->data)
+            av_free_packet(pkt);
+
+        if(is->quit) {
+            return -1;
+        }
+        /* next packet */
+        PROBE_START(get_start);
+        ret = packet_queue_get(&is->audioq, pkt);
+        if(ret <= 0) {
+            return ret;
+        }
+        PROBE_END(is, PROBE_AUDIOQ_GET, get_start);
+        if(!pkt->data) {
+            is->audio_finished = 1;
+            player_wake(is->player);
+        } else if(pkt->data == flush_pkt.data) {
+            audio_seek_reset(is, pkt->pts);
+            continue;
+        }
+        is->audio_pkt_data = pkt->data;
+        is->audio_pkt_size = pkt->size;
+        /* if update, update the audio clock w/pts */
+        if(pkt->pts != AV_NOPTS_VALUE) {
+            is->audio_clock = av_q2d(is->audio_st->time_base)*pkt->pts;
+        }
+
+    }
+
+}
+
+/* Bring 'nb_frames' of stretcher output to the device format in *buf.
+   Returns the size in bytes. */
+static int audio_stretch_output(VideoState *is, int nb_frames, uint8_t **buf) {
+    uint8_t *out[1];
+    const uint8_t *in[1];
+    int len;
+
+    if(is->audio_tgt_fmt == AV_SAMPLE_FMT_S16) {
+        *buf = (uint8_t *)is->stretch.out;
+        return nb_frames * is->audio_tgt_frame_size;
+    }
+    if(!is->stretch_swr) {
+        /* same rate and layout, only the sample format changes */
+        is->stretch_swr = swr_alloc_set_opts(NULL,
+                                             is->audio_tgt_layout, (AVSampleFormat)is->audio_tgt_fmt,
+                                             is->audio_tgt_freq,
+                                             is->audio_tgt_layout, AV_SAMPLE_FMT_S16,
+                                             is->audio_tgt_freq,
+                                             0, NULL);
+        if(!is->stretch_swr || swr_init(is->stretch_swr) < 0) {
+            fprintf(stderr, "Cannot initialize the audio resampler!\n");
+            swr_free(&is->stretch_swr);
+            return -1;
+        }
+    }
+    av_fast_malloc(&is->stretch_buf, &is->stretch_buf_size,
+                   nb_frames * is->audio_tgt_frame_size);
+    if(!is->stretch_buf) {
+        return -1;
+    }
+    out[0] = is->stretch_buf;
+    in[0] = (const uint8_t *)is->stretch.out;
+    len = swr_convert(is->stretch_swr, out, nb_frames, in, nb_frames);
+    if(len < 0) {
+        return -1;
+    }
+    *buf = is->stretch_buf;
+    return len * is->audio_tgt_frame_size;
+}
+
+/* Audio stage: decode a frame ahead of the callback and move it into
+   audio_ring, parking when audioq is empty or the ring is full. */
+static int audio_step(VideoState *is) {
+
+    TimeStretch *ts = &is->stretch;
+    int audio_size;
+    double pts, speed;
+    uint8_t *buf;
+
+    if(is->quit) {
+        return STEP_DONE;
+    }
+    if(is->audio_out) {
+        /* the last frame, or what of it did not fit */
+        audio_size = pcm_ring_write(&is->audio_ring, is->audio_out, is->audio_out_size);
+        if(audio_size < 0) {
+            return STEP_DONE;
+        }
+        is->audio_out += audio_size;
+        is->audio_out_size -= audio_size;
+        if(is->audio_out_size > 0) {
+            return pcm_ring_park(&is->audio_ring) ? STEP_AGAIN : STEP_PARKED;
+        }
+        pcm_ring_set_pts(&is->audio_ring, is->audio_clock - is->audio_out_latency,
+                         is->audio_out_speed);
+        is->audio_out = NULL;
+        return STEP_AGAIN;
+    }
+
+    /* the stretcher works on S16, convert to the device after it */
+    speed = is->speed;
+    audio_size = audio_decode_frame(is, &pts,
+                                    speed != 1.0 ? AV_SAMPLE_FMT_S16 : is->audio_tgt_fmt);
+    if(audio_size < 0) {
+        return STEP_DONE;
+    }
+    if(audio_size == 0) {
+        return packet_queue_park(&is->audioq, PACKET_QUEUE_WAIT_DATA) ? STEP_AGAIN : STEP_PARKED;
+    }
+    if(is->opts.headless) {
+        /* null sink */
+        return STEP_AGAIN;
+    }
+    buf = is->audio_buf;
+    is->audio_out_latency = 0;
+    if(speed != 1.0) {
+        audio_size = time_stretch_process(ts, (int16_t *)buf,
+                                          audio_size / (2 * is->audio_tgt_channels), speed);
+        if(audio_size < 0) {
+            return STEP_DONE;
+        }
+        audio_size = audio_stretch_output(is, audio_size, &buf);
+        if(audio_size < 0) {
+            return STEP_DONE;
+        }
+        /* input held back by the stretcher */
+        is->audio_out_latency = (double)(ts->in_frames + ts->overlap * ts->have_mid) / is->audio_tgt_freq;
+    } else if(ts->in_frames || ts->have_mid) {
+        /* back to normal speed, the little still held back is dropped */
+        time_stretch_reset(ts);
+    }
+    /* buf stays valid until the next frame is decoded */
+    is->audio_out = buf;
+    is->audio_out_size = audio_size;
+    is->audio_out_speed = speed;
+    return STEP_AGAIN;
+}
+
+/* Add one session's share of a device buffer to 'stream', staging it in
+   'buf'. Only copies what is already decoded, missing data mixes as silence. */
+static void audio_mix(VideoState *is, Uint8 *stream, int len, uint8_t *buf) {
+
+    int len1;
+    unsigned int fill;
+    double pts;
+    PROBE_START(start);
+
+    /* the device is now playing the buffer before this one, which ended
+       where this one starts */
+    pts = pcm_ring_pts(&is->audio_ring, is->audio_ring.rindex, is->audio_bytes_per_sec);
+    if(!isnan(pts)) {
+        clock_set(&is->audclk, pts - (double)is->audio_hw_buf_size / is->audio_bytes_per_sec *
+                               is->audio_ring.speed);
+    }
+
+    /* headroom left before this read, starting up or draining at the end
+       count neither here nor as an underrun */
+    fill = pcm_ring_fill(&is->audio_ring);
+    if(is->audio_ring.windex && !is->eof) {
+        if(!is->audio_ring.fill_samples || fill < is->audio_ring.fill_min) {
+            is->audio_ring.fill_min = fill;
+        }
+        is->audio_ring.fill_total += fill;
+        is->audio_ring.fill_samples++;
+    }
+    len1 = pcm_ring_read(&is->audio_ring, buf, len);
+    SDL_MixAudio(stream, buf, len1, SDL_MIX_MAXVOLUME);
+    if(len1 < len) {
+        if(is->audio_ring.windex && !is->eof) {
+            is->audio_ring.underruns++;
+        }
+    }
+    PROBE_END(is, PROBE_AUDIO_CALLBACK, start);
+}
+
+/* Runs on SDL's real-time audio thread: mix every playing session into the
+   one device. */
+void audio_callback(void *userdata, Uint8 *stream, int len) {
+
+    Player *pl = (Player *)userdata;
+    VideoState *is;
+    int i;
+
+    memset(stream, pl->audio_spec.silence, len);
+    for(i = 0; i < pl->nb_sessions; i++) {
+        is = pl->sessions[i];
+        if(is->audio_ready && !is->paused && !is->quit &&
+           (is->first_frame_time ||
+            clock_monotonic_us() - is->audio_ready_time > FIRST_FRAME_WAIT)) {
+            /* starts with the first picture, so that they start in sync */
+            audio_mix(is, stream, len, pl->mix_buf);
+        }
+    }
+}
+
+static int sdl_to_av_sample_fmt(Uint16 format) {
+    switch(format) {
+    case AUDIO_U8:
+        return AV_SAMPLE_FMT_U8;
+    case AUDIO_S16SYS:
+        return AV_SAMPLE_FMT_S16;
+    default:
+        return AV_SAMPLE_FMT_NONE;
+    }
+}
+
+/* Open the device for the first session with audio, later ones convert to
+   whatever it was opened with. */
+static int player_open_audio(Player *pl, SDL_AudioSpec *wanted_spec) {
+
+    SDL_AudioSpec spec;
+    int ret = 0;
+
+    SDL_LockMutex(pl->audio_mutex);
+    if(pl->audio_open) {
+        goto done;
+    }
+    wanted_spec->callback = audio_callback;
+    wanted_spec->userdata = pl;
+    /* let the device pick its own rate, channels and format, we
+       convert to whatever it gives us */
+    if(pl->headless) {
+        /* null sink, but still run the conversion to S16 */
+        spec = *wanted_spec;
+    } else if(SDL_OpenAudio(wanted_spec, &spec) < 0) {
+        fprintf(stderr, "SDL_OpenAudio: %s\n", SDL_GetError());
+        ret = -1;
+        goto done;
+    }
+    if(sdl_to_av_sample_fmt(spec.format) == AV_SAMPLE_FMT_NONE) {
+        /* nothing swresample can write, have SDL convert from S16 */
+        SDL_CloseAudio();
+        if(SDL_OpenAudio(wanted_spec, NULL) < 0) {
+            fprintf(stderr, "SDL_OpenAudio: %s\n", SDL_GetError());
+            ret = -1;
+            goto done;
+        }
+        spec = *wanted_spec;
+    }
+    if(!spec.size) {
+        spec.size = spec.samples * spec.channels * 2;
+    }
+    pl->mix_buf = (uint8_t *)av_malloc(spec.size);
+    if(!pl->mix_buf) {
+        if(!pl->headless) {
+            SDL_CloseAudio();
+        }
+        ret = -1;
+        goto done;
+    }
+    pl->audio_spec = spec;
+    pl->audio_open = 1;
+    if(!pl->headless) {
+        SDL_PauseAudio(0);
+    }
+done:
+    SDL_UnlockMutex(pl->audio_mutex);
+    return ret;
+}
+
+int get_cpu_count(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return n > 0 ? (int)n : 1;
+}
+
+/* Slices may only start on whole chroma rows, and formats that keep a
+   palette in data[1] can't be cut at all. The high bit depth planar ones
+   cut like their 8-bit versions: picture_slice works in bytes per row, and
+   the ordered dither down to 8 bits repeats every 8 rows, which every
+   slice start (a multiple of CONVERT_SLICE_ALIGN) keeps in phase. */
+static int convert_fmt_can_slice(int fmt) {
+    switch(fmt) {
+    case PIX_FMT_YUV420P:
+    case PIX_FMT_YUVJ420P:
+    case PIX_FMT_YUV422P:
+    case PIX_FMT_YUVJ422P:
+    case PIX_FMT_YUV444P:
+    case PIX_FMT_YUVJ444P:
+    case PIX_FMT_YUV411P:
+    case PIX_FMT_YUV420P9LE:
+    case PIX_FMT_YUV420P9BE:
+    case PIX_FMT_YUV420P10LE:
+    case PIX_FMT_YUV420P10BE:
+    case PIX_FMT_YUV420P16LE:
+    case PIX_FMT_YUV420P16BE:
+    case PIX_FMT_YUV422P9LE:
+    case PIX_FMT_YUV422P9BE:
+    case PIX_FMT_YUV422P10LE:
+    case PIX_FMT_YUV422P10BE:
+    case PIX_FMT_YUV422P16LE:
+    case PIX_FMT_YUV422P16BE:
+    case PIX_FMT_YUV444P9LE:
+    case PIX_FMT_YUV444P9BE:
+    case PIX_FMT_YUV444P10LE:
+    case PIX_FMT_YUV444P10BE:
+    case PIX_FMT_YUV444P16LE:
+    case PIX_FMT_YUV444P16BE:
+    case PIX_FMT_YUYV422:
+    case PIX_FMT_UYVY422:
+    case PIX_FMT_RGB24:
+    case PIX_FMT_BGR24:
+    case PIX_FMT_RGB32:
+    case PIX_FMT_GRAY8:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+/* A conversion that changes the vertical chroma subsampling filters chroma
+   across rows, slices scaled on their own would show seams at their edges. */
+static int convert_can_slice(int src_fmt, int dst_fmt) {
+    int h_shift, src_v_shift, dst_v_shift;
+
+    if(!convert_fmt_can_slice(src_fmt) || !convert_fmt_can_slice(dst_fmt)) {
+        return 0;
+    }
+    avcodec_get_chroma_sub_sample((PixelFormat)src_fmt, &h_shift, &src_v_shift);
+    avcodec_get_chroma_sub_sample((PixelFormat)dst_fmt, &h_shift, &dst_v_shift);
+    return src_v_shift == dst_v_shift;
+}
+
+/* point 'slice' at row y of a picture in the given format */
+static void picture_slice(AVPicture *slice, AVPicture *pict, int fmt, int y) {
+    int h_shift, v_shift, i;
+
+    avcodec_get_chroma_sub_sample((PixelFormat)fmt, &h_shift, &v_shift);
+    for(i = 0; i < 4; i++) {
+        slice->linesize[i] = pict->linesize[i];
+        slice->data[i] = pict->data[i] ?
+            pict->data[i] + ((i == 1 || i == 2) ? y >> v_shift : y) * pict->linesize[i] :
+            NULL;
+    }
+}
+
+void convert_job_init(ConvertJob *job) {
+    memset(job, 0, sizeof(*job));
+    job->mutex = SDL_CreateMutex();
+    job->done_cond = SDL_CreateCond();
+}
+
+void convert_job_free(ConvertJob *job) {
+    sws_cache_free(&job->sws_cache);
+    SDL_DestroyCond(job->done_cond);
+    SDL_DestroyMutex(job->mutex);
+}
+
+/* Convert slices of the current conversion until there are none left.
+   Each slice is scaled as a picture of its own, the player never resizes
+   vertically and convert_can_slice keeps the vertical chroma subsampling,
+   so slices don't depend on their neighbours. */
+static void convert_job_work(ConvertJob *job, SwsCache *cache, unsigned int generation) {
+    AVPicture src, dst;
+    struct SwsContext *ctx;
+    int slice, y, h;
+
+    SDL_LockMutex(job->mutex);
+    while(job->generation == generation && job->next_slice < job->nb_slices) {
+        slice = job->next_slice++;
+        SDL_UnlockMutex(job->mutex);
+
+        y = slice * job->slice_height;
+        h = FFMIN(job->slice_height, job->height - y);
+        ctx = sws_cache_get(cache, job->width, h, job->src_fmt,
+                            job->width, h, job->dst_fmt, job->flags);
+        if(ctx) {
+            picture_slice(&src, job->src, job->src_fmt, y);
+            picture_slice(&dst, job->dst, job->dst_fmt, y);
+            sws_scale(ctx, src.data, src.linesize, 0, h, dst.data, dst.linesize);
+        }
+
+        SDL_LockMutex(job->mutex);
+        if(++job->slices_done == job->nb_slices) {
+            SDL_CondSignal(job->done_cond);
+        }
+    }
+    SDL_UnlockMutex(job->mutex);
+}
+
+/* executor task: help with whatever conversion the job has going on */
+static void convert_ticket_run(void *opaque, ExecWorker *w) {
+    ConvertJob *job = (ConvertJob *)opaque;
+    unsigned int generation;
+
+    SDL_LockMutex(job->mutex);
+    generation = job->generation;
+    SDL_UnlockMutex(job->mutex);
+    convert_job_work(job, &w->sws_cache, generation);
+}
+
+/* Convert a whole picture, returns once every slice is done. The caller
+   converts slices too instead of just waiting for the workers, tickets
+   that only run after it finished find nothing left to do or help with
+   the next conversion. */
+void convert_run(Executor *e, ConvertJob *job, int prio, AVPicture *src, int src_fmt,
+                 AVPicture *dst, int dst_fmt, int width, int height, int flags) {
+    int nb_slices = convert_can_slice(src_fmt, dst_fmt) ? e->nb_workers : 1;
+    unsigned int generation;
+    int i;
+
+    SDL_LockMutex(job->mutex);
+    generation = ++job->generation;
+    job->src = src;
+    job->dst = dst;
+    job->src_fmt = src_fmt;
+    job->dst_fmt = dst_fmt;
+    job->width = width;
+    job->height = height;
+    job->flags = flags;
+    job->slice_height = FFALIGN((height + nb_slices - 1) / nb_slices, CONVERT_SLICE_ALIGN);
+    job->nb_slices = (height + job->slice_height - 1) / job->slice_height;
+    job->next_slice = 0;
+    job->slices_done = 0;
+    SDL_UnlockMutex(job->mutex);
+
+    for(i = 1; i < job->nb_slices; i++) {
+        if(executor_submit(e, prio, convert_ticket_run, job) < 0) {
+            break;
+        }
+    }
+
+    convert_job_work(job, &job->sws_cache, generation);
+
+    SDL_LockMutex(job->mutex);
+    while(job->slices_done < job->nb_slices) {
+        SDL_CondWait(job->done_cond, job->mutex);
+    }
+    SDL_UnlockMutex(job->mutex);
+}
+
+static void frame_buffer_unref(FrameBuffer *fb) {
+    __sync_sub_and_fetch(&fb->refcount, 1);
+}
+
+/* (re)allocate the YUV420P buffer of a picture, called by the decoder */
+static void picture_alloc(VideoPicture *vp, int width, int height) {
+    if(vp->allocated) {
+        avpicture_free(&vp->buf);
+    }
+    vp->allocated = avpicture_alloc(&vp->buf, PIX_FMT_YUV420P, width, height) >= 0;
+    vp->buf_width = width;
+    vp->buf_height = height;
+}
+
+/* Park the video stage until pictq has room for a picture, it then returns
+   STEP_PARKED. Returns 1 if there is room already or the session closes,
+   pictq_next_picture wakes it otherwise. */
+static int pictq_park(VideoState *is) {
+    is->pictq_waiting = 1;
+    __sync_synchronize();
+    if(is->pictq_size < is->pictq_depth || is->quit) {
+        __sync_bool_compare_and_swap(&is->pictq_waiting, 1, 0);
+        return 1;
+    }
+    return 0;
+}
+
+/* Convert a picture into the free pictq slot, the caller made sure there
+   is one. */
+int queue_picture(VideoState *is, AVFrame *pFrame, double pts) {
+
+    VideoPicture *vp;
+    int dst_pix_fmt, w, h, direct;
+    struct SwsContext *img_convert_ctx;
+
+    // windex is set to 0 initially
+    vp = &is->pictq[is->pictq_windex];
+    /* geometry and format both from the frame, the codec context may
+       already describe the next resolution */
+    w = pFrame->width;
+    h = pFrame->height;
+
+    dst_pix_fmt = PIX_FMT_YUV420P;
+    direct = pFrame->type == FF_BUFFER_TYPE_USER && pFrame->format == dst_pix_fmt;
+    /* resize the conversion buffer! The slot is not queued, so nobody else
+       looks at it. A picture in the decoder's buffer needs none. */
+    if(!direct && (!vp->allocated || vp->buf_width != w || vp->buf_height != h)) {
+        picture_alloc(vp, w, h);
+        if(!vp->allocated) {
+            return 0;
+        }
+    }
+    /* We have a place to put our picture on the queue */
+    vp->width = w;
+    vp->height = h;
+    PROBE_START(start);
+
+    if(direct) {
+        /* already what SDL wants, just reference the decoder's buffer */
+        vp->fb = (FrameBuffer *)pFrame->opaque;
+        __sync_add_and_fetch(&vp->fb->refcount, 1);
+        memcpy(vp->pict.data, pFrame->data, sizeof(vp->pict.data));
+        memcpy(vp->pict.linesize, pFrame->linesize, sizeof(vp->pict.linesize));
+    } else if(is->player->exec->nb_workers > 1) {
+        vp->fb = NULL;
+        vp->pict = vp->buf;
+        convert_run(is->player->exec, &is->convert_job, stream_priority(is),
+                    (AVPicture *)pFrame, pFrame->format,
+                    &vp->pict, dst_pix_fmt, w, h, SWS_BICUBIC);
+    } else {
+        // Convert the image into YUV format that SDL uses
+        img_convert_ctx = sws_cache_get(&is->sws_cache,
+                                        w, h, pFrame->format,
+                                        w, h, dst_pix_fmt, SWS_BICUBIC);
+        if(img_convert_ctx == NULL) {
+            fprintf(stderr, "Cannot initialize the conversion context!\n");
+            exit(1);
+        }
+        vp->fb = NULL;
+        vp->pict = vp->buf;
+        sws_scale(img_convert_ctx, pFrame->data, pFrame->linesize,
+                  0, h, vp->pict.data, vp->pict.linesize);
+    }
+
+    vp->pts = pts;
+    vp->serial = is->videoq.consumer_serial;
+    PROBE_END(is, PROBE_CONVERT, start);
+
+    /* now we inform our display thread that we have a pic ready */
+    if(++is->pictq_windex == is->pictq_depth) {
+
+        is->pictq_windex = 0;
+
+    }
+
+    SDL_LockMutex(is->pictq_mutex);
+    is->pictq_size++;
+    SDL_UnlockMutex(is->pictq_mutex);
+    player_wake(is->player);
+
+    return 0;
+}
+
+double synchronize_video(VideoState *is, AVFrame *src_frame, double pts) {
+
+    double frame_delay;
+
+    if(pts != 0 && pts < is->video_last_pts) {
+        /* the decoder handed out pictures out of order: count it for
+           -headless, the picture keeps its own timestamp */
+        is->video_pts_errors++;
+    }
+    if(pts != 0) {
+        /* if we have pts, set video clock to it */
+        is->video_clock = pts;
+        is->video_last_pts = pts;
+    } else {
+        /* if we aren't given a pts, set it to the clock */
+        pts = is->video_clock;
+    }
+    /* update the video clock */
+    frame_delay = av_q2d(is->video_st->codec->time_base);
+    /* if we are repeating a frame, adjust clock accordingly */
+    frame_delay += src_frame->repeat_pict * (frame_delay * 0.5);
+    is->video_clock += frame_delay;
+    return pts;
+}
+
+/* Adapt how much the decoder does to how far it lags behind the master
+   clock. Skip non-reference frames while the lag persists, and when even
+   that is not enough, drop packets up to the next keyframe. Both
+   stop again once the decoder caught up, the refresh keeps dropping any
+   single late picture. */
+static void video_frame_skip_policy(VideoState *is, double pts) {
+    AVCodecContext *codecCtx = is->video_st->codec;
+    double lag;
+
+    if(is->speed >= SKIP_NONREF_SPEED) {
+        /* most of these pictures would be dropped for being late anyway,
+           don't spend the CPU on decoding them */
+        codecCtx->skip_frame = AVDISCARD_NONREF;
+        return;
+    }
+    if(is->av_sync_type == AV_SYNC_VIDEO_MASTER || is->opts.headless ||
+       !is->first_frame_time) {
+        /* nothing to catch up with before the first picture is up */
+        codecCtx->skip_frame = AVDISCARD_DEFAULT;
+        return;
+    }
+    lag = get_master_clock(is) - pts;
+    if(lag > AV_NOSYNC_THRESHOLD) {
+        /* clocks are not related (yet), don't act on it */
+        return;
+    }
+
+    if(lag > SKIP_TO_KEY_LAG) {
+        is->video_skip_to_key = 1;
+    }
+
+    if(lag > SKIP_NONREF_LAG) {
+        if(++is->video_late_frames >= SKIP_NONREF_FRAMES) {
+            codecCtx->skip_frame = AVDISCARD_NONREF;
+        }
+    } else {
+        is->video_late_frames = 0;
+        if(lag < SKIP_NONREF_LAG / 2) {
+            codecCtx->skip_frame = AVDISCARD_DEFAULT;
+        }
+    }
+}
+
+/* A flush marker came through videoq: restart the decoder and the
+   late-frame policy, pictures still in pictq are dropped by the refresh. */
+static void video_seek_reset(VideoState *is, int64_t target) {
+    AVCodecContext *codecCtx = is->video_st->codec;
+
+    avcodec_flush_buffers(codecCtx);
+    is->video_decoder_primed = 0;
+    codecCtx->skip_frame = AVDISCARD_DEFAULT;
+    is->video_skip_to_key = 0;
+    is->video_late_frames = 0;
+    is->video_finished = 0;
+    is->video_seeking = 1;
+    is->video_seek_target = target / (double)AV_TIME_BASE;
+    is->video_clock = is->video_seek_target;
+    is->video_last_pts = 0;
+}
+
+/* the video stage ended */
+static int video_stage_end(VideoState *is) {
+    if(is->video_pts_errors) {
+        fprintf(stderr, "%s: %d pictures with non-monotonic timestamps\n",
+                is->filename, is->video_pts_errors);
+    }
+    if(is->frame_drops_late || is->frame_drops_packets || is->frame_skips_nonref) {
+        fprintf(stderr, "%s: fell behind, dropped %d pictures and %d packets, skipped ~%d non-reference frames\n",
+                is->filename, is->frame_drops_late, is->frame_drops_packets, is->frame_skips_nonref);
+    }
+    av_free(is->video_frame);
+    is->video_frame = NULL;
+    return STEP_DONE;
+}
+
+/* Video stage: queue the picture decoded last time once pictq has room,
+   or else decode the next packet. At the end of the stream the empty
+   packet gets the delayed pictures out of the decoder, one per step. */
+static int video_step(VideoState *is) {
+    AVPacket *packet = &is->video_pkt;
+    AVFrame *pFrame = is->video_frame;
+    int frameFinished, ret;
+    double pts;
+
+    if(is->quit) {
+        return video_stage_end(is);
+    }
+    if(is->video_frame_ready) {
+        if(is->pictq_size >= is->pictq_depth) {
+            return pictq_park(is) ? STEP_AGAIN : STEP_PARKED;
+        }
+        queue_picture(is, pFrame, is->video_frame_pts);
+        is->probes.video_frames++;
+        is->video_frame_ready = 0;
+        return STEP_AGAIN;
+    }
+
+    if(!is->video_draining) {
+        PROBE_START(get_start);
+        ret = packet_queue_get(&is->videoq, packet);
+        if(ret < 0) {
+            // means we quit getting packets
+            return video_stage_end(is);
+        }
+        if(ret == 0) {
+            return packet_queue_park(&is->videoq, PACKET_QUEUE_WAIT_DATA) ? STEP_AGAIN : STEP_PARKED;
+        }
+        PROBE_END(is, PROBE_VIDEOQ_GET, get_start);
+
+        if(packet->data == flush_pkt.data) {
+            video_seek_reset(is, packet->pts);
+            return STEP_AGAIN;
+        }
+        if(is->video_skip_to_key && packet->data) {
+            if(!(packet->flags & AV_PKT_FLAG_KEY)) {
+                is->frame_drops_packets++;
+                av_free_packet(packet);
+                return STEP_AGAIN;
+            }
+            /* restart cleanly from the keyframe, whatever the codec still
+               holds is late anyway */
+            avcodec_flush_buffers(is->video_st->codec);
+            is->video_decoder_primed = 0;
+            is->video_skip_to_key = 0;
+        }
+        is->video_draining = !packet->data;
+    }
+
+    PROBE_START(start);
+    pts = 0;
+    /* Decode video frame, an empty packet at EOF returns the delayed ones.
+       A packet that fails to decode gives no frame and is dropped below. */
+    avcodec_decode_video2(is->video_st->codec, pFrame, &frameFinished, packet);
+    PROBE_END(is, PROBE_VIDEO_DECODE, start);
+
+    // Did we get a video frame?
+    if(frameFinished) {
+        is->video_decoder_primed = 1;
+        /* the codec tracks which packet a (possibly reordered or
+           frame-threaded) picture came from, so trust its guess */
+        if(pFrame->best_effort_timestamp != AV_NOPTS_VALUE) {
+            pts = pFrame->best_effort_timestamp * av_q2d(is->video_st->time_base);
+        }
+        pts = synchronize_video(is, pFrame, pts);
+        if(is->video_seeking && pts < is->video_seek_target) {
+            /* decoding forward from the keyframe to the seek target */
+        } else {
+            is->video_seeking = 0;
+            video_frame_skip_policy(is, pts);
+            /* the frame stays valid until the next decode call */
+            is->video_frame_ready = 1;
+            is->video_frame_pts = pts;
+        }
+    } else if(is->video_st->codec->skip_frame != AVDISCARD_DEFAULT &&
+              is->video_decoder_primed && !is->video_draining) {
+        /* a primed decoder gives a picture for every packet it decodes,
+           before that a frameless packet only fills its delay */
+        is->frame_skips_nonref++;
+    }
+    if(!is->video_draining) {
+        av_free_packet(packet);
+    } else if(!frameFinished) {
+        /* decoder drained, tell the sink nothing else is coming */
+        is->video_draining = 0;
+        is->video_finished = 1;
+        player_wake(is->player);
+    }
+    return STEP_AGAIN;
+}
+
+/* Direct rendering: let the codec decode straight into our frame pool.
+   Only the video stage's decoder takes buffers, so a free one (refcount 0) can't
+   be grabbed by anybody else while we set it up. */
+int video_get_buffer(struct AVCodecContext *c, AVFrame *pic) {
+    VideoState *is = (VideoState *)c->opaque;
+    FrameBuffer *fb = NULL;
+    int w = c->width, h = c->height;
+    int i;
+
+    if(c->pix_fmt != PIX_FMT_YUV420P) {
+        /* the pool only holds YUV420P, the stream changed format since open */
+        return avcodec_default_get_buffer(c, pic);
+    }
+    for(i = 0; i < FRAME_POOL_SIZE; i++) {
+        if(is->frame_pool[i].refcount == 0) {
+            fb = &is->frame_pool[i];
+            break;
+        }
+    }
+    if(!fb) {
+        /* every buffer is referenced, fall back to a codec-owned one */
+        return avcodec_default_get_buffer(c, pic);
+    }
+
+    avcodec_align_dimensions(c, &w, &h);
+    w = FFALIGN(w, 64); /* keep the chroma lines SIMD-aligned too */
+    if(!fb->pict.data[0] || fb->width != w || fb->height != h) {
+        if(fb->pict.data[0]) {
+            avpicture_free(&fb->pict);
+        }
+        if(avpicture_alloc(&fb->pict, PIX_FMT_YUV420P, w, h) < 0) {
+            memset(&fb->pict, 0, sizeof(fb->pict));
+            return -1;
+        }
+        fb->width = w;
+        fb->height = h;
+    }
+    fb->refcount = 1;
+    /* what avcodec_default_get_buffer would fill in for the timestamps */
+    pic->pkt_pts = c->pkt ? c->pkt->pts : AV_NOPTS_VALUE;
+    pic->reordered_opaque = c->reordered_opaque;
+
+    for(i = 0; i < 3; i++) {
+        pic->base[i] = pic->data[i] = fb->pict.data[i];
+        pic->linesize[i] = fb->pict.linesize[i];
+    }
+    pic->type = FF_BUFFER_TYPE_USER;
+    pic->age = INT_MAX; /* content is unknown to the codec */
+    pic->opaque = fb;
+    return 0;
+}
+
+void video_release_buffer(struct AVCodecContext *c, AVFrame *pic) {
+    int i;
+
+    if(pic->type != FF_BUFFER_TYPE_USER) {
+        avcodec_default_release_buffer(c, pic);
+        return;
+    }
+    frame_buffer_unref((FrameBuffer *)pic->opaque);
+    for(i = 0; i < 4; i++) {
+        pic->data[i] = NULL;
+    }
+    pic->opaque = NULL;
+}
+
+int stream_component_open(VideoState *is, int stream_index) {
+
+    AVFormatContext *pFormatCtx = is->pFormatCtx;
+    AVCodecContext *codecCtx;
+    AVCodec *codec;
+    SDL_AudioSpec wanted_spec, spec;
+
+    if(stream_index < 0 || stream_index >= (int)pFormatCtx->nb_streams) {
+        return -1;
+    }
+
+    // Get a pointer to the codec context for the video stream
+    codecCtx = pFormatCtx->streams[stream_index]->codec;
+
+    if(codecCtx->codec_type == AVMEDIA_TYPE_AUDIO) {
+        // Set audio settings from codec info
+        wanted_spec.freq = codecCtx->sample_rate;
+        wanted_spec.format = AUDIO_S16SYS;
+        wanted_spec.channels = codecCtx->channels;
+        wanted_spec.silence = 0;
+        wanted_spec.samples = SDL_AUDIO_BUFFER_SIZE;
+        if(player_open_audio(is->player, &wanted_spec) < 0) {
+            return -1;
+        }
+        spec = is->player->audio_spec;
+        is->audio_hw_buf_size = spec.size;
+        is->audio_tgt_fmt = sdl_to_av_sample_fmt(spec.format);
+        is->audio_tgt_freq = spec.freq;
+        is->audio_tgt_channels = spec.channels;
+        is->audio_tgt_layout = av_get_default_channel_layout(spec.channels);
+        is->audio_tgt_frame_size = spec.channels *
+                                   av_get_bytes_per_sample((AVSampleFormat)is->audio_tgt_fmt);
+    }
+    codec = avcodec_find_decoder(codecCtx->codec_id);
+
+    if(codec && codecCtx->codec_type == AVMEDIA_TYPE_VIDEO) {
+        codecCtx->opaque = is;
+        codecCtx->thread_count = is->opts.video_threads;
+        if(!strcmp(is->opts.video_thread_type, "frame")) {
+            codecCtx->thread_type = FF_THREAD_FRAME;
+        } else if(!strcmp(is->opts.video_thread_type, "slice")) {
+            codecCtx->thread_type = FF_THREAD_SLICE;
+        } else {
+            codecCtx->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+        }
+        if((codec->capabilities & CODEC_CAP_DR1) && codecCtx->pix_fmt == PIX_FMT_YUV420P) {
+            /* our frame pool has no room for edges around the picture */
+            codecCtx->flags |= CODEC_FLAG_EMU_EDGE;
+            codecCtx->get_buffer = video_get_buffer;
+            codecCtx->release_buffer = video_release_buffer;
+        }
+    }
+
+    if(!codec || (avcodec_open2(codecCtx, codec, NULL) < 0)) {
+        fprintf(stderr, "Unsupported codec!\n");
+        return -1;
+    }
+
+    switch(codecCtx->codec_type) {
+
+    case AVMEDIA_TYPE_AUDIO:
+        is->audioStream = stream_index;
+        is->audio_st = pFormatCtx->streams[stream_index];
+        is->audio_bytes_per_sec = is->audio_tgt_freq * is->audio_tgt_frame_size;
+        if(time_stretch_init(&is->stretch, is->audio_tgt_freq, is->audio_tgt_channels) < 0) {
+            fprintf(stderr, "Could not allocate the time stretcher\n");
+            return -1;
+        }
+        /* whole sample frames of audio_ring_ms, at least one device buffer */
+        if(pcm_ring_init(&is->audio_ring,
+                         FFMAX(is->opts.audio_ring_ms * is->audio_tgt_freq / 1000,
+                               SDL_AUDIO_BUFFER_SIZE) * is->audio_tgt_frame_size,
+                         &is->audio_stage) < 0) {
+            fprintf(stderr, "Could not allocate the audio buffer\n");
+            return -1;
+        }
+        memset(&is->audio_pkt, 0, sizeof(is->audio_pkt));
+        is->audio_frame = avcodec_alloc_frame();
+        /* averaging filter for the A-V difference, and the smallest average
+           worth correcting: below that the device buffering hides it */
+        is->audio_diff_avg_coef = exp(log(0.01) / AUDIO_DIFF_AVG_NB);
+        is->audio_diff_avg_count = 0;
+        is->audio_diff_threshold = 2.0 * SDL_AUDIO_BUFFER_SIZE / is->audio_tgt_freq;
+        packet_queue_init(&is->audioq, is->audio_st->time_base,
+                          is->opts.pool_max_kb > 0 ? &is->packet_pool : NULL,
+                          &is->demux_stage, &is->audio_stage);
+        packet_queue_set_limits(&is->audioq,
+                                is->opts.audioq_max_size, is->opts.audioq_min_size,
+                                is->opts.audioq_max_duration, is->opts.audioq_min_duration);
+        is->audioq.bit_rate = stream_bit_rate(pFormatCtx, codecCtx);
+        player_split_budget(is->player);
+        stage_start(&is->audio_stage, is->player->exec, is, audio_step);
+        /* the ring is set up, the callback may start mixing it */
+        is->audio_ready_time = clock_monotonic_us();
+        __sync_synchronize();
+        is->audio_ready = 1;
+        break;
+
+    case AVMEDIA_TYPE_VIDEO:
+        is->videoStream = stream_index;
+        is->video_st = pFormatCtx->streams[stream_index];
+
+        is->frame_timer = (double)clock_monotonic_us() / 1000000.0;
+        is->frame_last_delay = 40e-3;
+
+        packet_queue_init(&is->videoq, is->video_st->time_base,
+                          is->opts.pool_max_kb > 0 ? &is->packet_pool : NULL,
+                          &is->demux_stage, &is->video_stage);
+        packet_queue_set_limits(&is->videoq,
+                                is->opts.videoq_max_size, is->opts.videoq_min_size,
+                                is->opts.videoq_max_duration, is->opts.videoq_min_duration);
+        is->videoq.bit_rate = stream_bit_rate(pFormatCtx, codecCtx);
+        player_split_budget(is->player);
+        is->video_frame = avcodec_alloc_frame();
+        stage_start(&is->video_stage, is->player->exec, is, video_step);
+        break;
+
+    default:
+        break;
+    }
+    return 0;
+}
+
+/* hint the kernel to start reading [offset, offset + len) in the background */
+static void readahead_advise(int fd, int64_t offset, int len) {
+#ifdef __DARWIN__
+    struct radvisory ra;
+
+    ra.ra_offset = offset;
+    ra.ra_count = len;
+    fcntl(fd, F_RDADVISE, &ra);
+#elif defined(POSIX_FADV_WILLNEED)
+    posix_fadvise(fd, offset, len, POSIX_FADV_WILLNEED);
+#endif
+}
+
+/* room in the ring and something left to read */
+static int readahead_wants_fill(ReadAhead *ra) {
+    return !ra->abort_request && !ra->eof && !ra->error && ra->fill_pos - ra->pos < ra->size;
+}
+
+/* Read the next chunk into the ring, with mutex held; it is dropped during
+   the read. Only one reader at a time, see 'filling'. */
+static void readahead_fill(ReadAhead *ra) {
+    unsigned int generation;
+    int64_t offset;
+    int len;
+    ssize_t ret;
+
+    /* up to the chunk size, the free space and the end of the ring */
+    offset = ra->fill_pos;
+    generation = ra->generation;
+    len = FFMIN(READAHEAD_CHUNK, ra->size - (int)(ra->fill_pos - ra->pos));
+    len = FFMIN(len, ra->size - (int)(offset % ra->size));
+    /* the oldest bytes, behind pos, are about to be overwritten */
+    ra->start = FFMAX(ra->start, offset + len - ra->size);
+    ra->filling = 1;
+    SDL_UnlockMutex(ra->mutex);
+
+    readahead_advise(ra->fd, offset + len, ra->size);
+    ret = pread(ra->fd, ra->buf + offset % ra->size, len, offset);
+
+    SDL_LockMutex(ra->mutex);
+    ra->filling = 0;
+    if(generation == ra->generation) {
+        if(ret > 0) {
+            ra->fill_pos += ret;
+            ra->bytes_read += ret;
+        } else if(ret == 0) {
+            ra->eof = 1;
+        } else if(errno != EINTR) {
+            ra->error = errno;
+        }
+    }
+    /* else seeked away meanwhile, the data is not wanted */
+    SDL_CondBroadcast(ra->cond);
+}
+
+/* Executor task: fill the ring until it is full or the file ends. */
+static void readahead_task(void *opaque, ExecWorker *w) {
+    ReadAhead *ra = (ReadAhead *)opaque;
+
+    SDL_LockMutex(ra->mutex);
+    while(readahead_wants_fill(ra) && !ra->filling) {
+        readahead_fill(ra);
+    }
+    ra->fill_queued = 0;
+    SDL_CondBroadcast(ra->cond);
+    SDL_UnlockMutex(ra->mutex);
+}
+
+/* Queue a fill task if the ring has room and none is queued, with mutex
+   held. If the executor has no room, the demuxer reads on demand. */
+static void readahead_kick(ReadAhead *ra) {
+    if(ra->exec && !ra->fill_queued && readahead_wants_fill(ra)) {
+        ra->fill_queued = 1;
+        if(executor_submit(ra->exec, TASK_PRIO_NORMAL, readahead_task, ra) < 0) {
+            ra->fill_queued = 0;
+        }
+    }
+}
+
+/* AVIOContext read_packet: copy what the ring already has. When it has
+   nothing, wait for a read in flight or read the next chunk right here. */
+static int readahead_read(void *opaque, uint8_t *buf, int buf_size) {
+    ReadAhead *ra = (ReadAhead *)opaque;
+    int64_t pos;
+    int len, len1, done = 0;
+
+    SDL_LockMutex(ra->mutex);
+    if(ra->pos == ra->fill_pos && !ra->eof && !ra->error && !ra->abort_request) {
+        ra->stalls++;
+        while(ra->pos == ra->fill_pos && !ra->eof && !ra->error && !ra->abort_request) {
+            if(ra->filling) {
+                SDL_CondWait(ra->cond, ra->mutex);
+            } else {
+                readahead_fill(ra);
+            }
+        }
+    }
+    pos = ra->pos;
+    len = (int)FFMIN(buf_size, ra->fill_pos - ra->pos);
+    if(len <= 0) {
+        /* 0 is end of file: avio keeps a negative value in pb->error,
+           which the demux loop would take for a read error */
+        len = ra->abort_request ? AVERROR_EXIT :
+              ra->error ? AVERROR(ra->error) : 0;
+        SDL_UnlockMutex(ra->mutex);
+        return len;
+    }
+    SDL_UnlockMutex(ra->mutex);
+
+    /* fills never write over [pos, fill_pos), copy unlocked */
+    while(done < len) {
+        len1 = FFMIN(len - done, ra->size - (int)((pos + done) % ra->size));
+        memcpy(buf + done, ra->buf + (pos + done) % ra->size, len1);
+        done += len1;
+    }
+
+    SDL_LockMutex(ra->mutex);
+    ra->pos += len;
+    ra->bytes_copied += len;
+    readahead_kick(ra);
+    SDL_UnlockMutex(ra->mutex);
+    return len;
+}
+
+/* AVIOContext seek: stay on the ring if the target is in it, otherwise
+   drop it and restart filling there. */
+static int64_t readahead_seek(void *opaque, int64_t offset, int whence) {
+    ReadAhead *ra = (ReadAhead *)opaque;
+    int64_t target;
+
+    whence &= ~AVSEEK_FORCE;
+    if(whence == AVSEEK_SIZE) {
+        return ra->file_size;
+    }
+    SDL_LockMutex(ra->mutex);
+    if(whence == SEEK_SET) {
+        target = offset;
+    } else if(whence == SEEK_CUR) {
+        target = ra->pos + offset;
+    } else if(whence == SEEK_END) {
+        target = ra->file_size + offset;
+    } else {
+        SDL_UnlockMutex(ra->mutex);
+        return -1;
+    }
+    if(target < 0) {
+        SDL_UnlockMutex(ra->mutex);
+        return -1;
+    }
+    if(target < ra->start || target > ra->fill_pos) {
+        ra->generation++;
+        ra->start = ra->fill_pos = target;
+        ra->eof = 0;
+        ra->error = 0;
+    }
+    ra->pos = target;
+    readahead_kick(ra);
+    SDL_UnlockMutex(ra->mutex);
+    return target;
+}
+
+/* Open 'filename' for reading through a ring of 'size' bytes, filled by
+   tasks on 'exec'. Fails for anything that is not a regular file, like
+   URLs. */
+static int readahead_open(ReadAhead *ra, const char *filename, int size, Executor *exec) {
+    struct stat st;
+
+    memset(ra, 0, sizeof(*ra));
+    ra->fd = open(filename, O_RDONLY);
+    if(ra->fd < 0) {
+        return -1;
+    }
+    if(fstat(ra->fd, &st) < 0 || !S_ISREG(st.st_mode) ||
+       !(ra->buf = (uint8_t *)av_malloc(size))) {
+        close(ra->fd);
+        return -1;
+    }
+    ra->file_size = st.st_size;
+    ra->size = size;
+#ifdef __DARWIN__
+    fcntl(ra->fd, F_RDAHEAD, 1);
+#elif defined(POSIX_FADV_SEQUENTIAL)
+    posix_fadvise(ra->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    ra->exec = exec;
+    ra->mutex = SDL_CreateMutex();
+    ra->cond = SDL_CreateCond();
+    SDL_LockMutex(ra->mutex);
+    readahead_kick(ra);
+    SDL_UnlockMutex(ra->mutex);
+    return 0;
+}
+
+/* Wake everybody and make every read fail, from any thread. */
+static void readahead_abort(ReadAhead *ra) {
+    if(!ra->mutex) {
+        return;
+    }
+    SDL_LockMutex(ra->mutex);
+    ra->abort_request = 1;
+    SDL_CondBroadcast(ra->cond);
+    SDL_UnlockMutex(ra->mutex);
+}
+
+/* Wait for the fill task and free the ring, the AVIOContext must be gone. */
+static void readahead_close(ReadAhead *ra) {
+    if(!ra->mutex) {
+        return;
+    }
+    readahead_abort(ra);
+    SDL_LockMutex(ra->mutex);
+    while(ra->fill_queued) {
+        SDL_CondWait(ra->cond, ra->mutex);
+    }
+    SDL_UnlockMutex(ra->mutex);
+    SDL_DestroyCond(ra->cond);
+    SDL_DestroyMutex(ra->mutex);
+    av_free(ra->buf);
+    close(ra->fd);
+    ra->mutex = NULL;
+}
+
+/* Map 'filename', NULL for anything that is not a regular file. */
+static MappedFile *mapped_file_open(const char *filename) {
+    MappedFile *map;
+    struct stat st;
+    void *data;
+    int fd;
+
+    fd = open(filename, O_RDONLY);
+    if(fd < 0) {
+        return NULL;
+    }
+    if(fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size <= 0 ||
+       (uint64_t)st.st_size > (size_t)-1) {
+        close(fd);
+        return NULL;
+    }
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    /* the mapping keeps the file, not the descriptor */
+    close(fd);
+    if(data == MAP_FAILED) {
+        return NULL;
+    }
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+    map = (MappedFile *)av_mallocz(sizeof(MappedFile));
+    if(!map) {
+        munmap(data, st.st_size);
+        return NULL;
+    }
+    map->data = (uint8_t *)data;
+    map->size = st.st_size;
+    map->refcount = 1;
+    return map;
+}
+
+static MappedFile *mapped_file_ref(MappedFile *map) {
+    __sync_add_and_fetch(&map->refcount, 1);
+    return map;
+}
+
+static void mapped_file_unref(MappedFile *map) {
+    if(map && !__sync_sub_and_fetch(&map->refcount, 1)) {
+        munmap(map->data, map->size);
+        av_free(map);
+    }
+}
+
+/* AVIOContext read_packet: the only copy of the payload, page the next
+   stretch of the file in ahead of it. */
+static int mmap_read(void *opaque, uint8_t *buf, int buf_size) {
+    MmapReader *r = (MmapReader *)opaque;
+    MappedFile *map = r->map;
+    int64_t start;
+    int len;
+
+    if(r->pos >= map->size) {
+        /* end of file, as readahead_read */
+        return 0;
+    }
+    len = (int)FFMIN(buf_size, map->size - r->pos);
+    if(r->pos + len > r->advised) {
+        start = r->pos & ~(int64_t)(sysconf(_SC_PAGESIZE) - 1);
+        r->advised = FFMIN(r->pos + len + MMAP_WILLNEED, map->size);
+        madvise(map->data + start, r->advised - start, MADV_WILLNEED);
+    }
+    memcpy(buf, map->data + r->pos, len);
+    r->pos += len;
+    r->bytes_copied += len;
+    return len;
+}
+
+static int64_t mmap_seek(void *opaque, int64_t offset, int whence) {
+    MmapReader *r = (MmapReader *)opaque;
+    int64_t target;
+
+    whence &= ~AVSEEK_FORCE;
+    if(whence == AVSEEK_SIZE) {
+        return r->map->size;
+    } else if(whence == SEEK_SET) {
+        target = offset;
+    } else if(whence == SEEK_CUR) {
+        target = r->pos + offset;
+    } else if(whence == SEEK_END) {
+        target = r->map->size + offset;
+    } else {
+        return -1;
+    }
+    if(target < 0) {
+        return -1;
+    }
+    r->pos = target;
+    /* page in from the new position on the next read */
+    r->advised = target;
+    return target;
+}
+
+/* An AVIOContext reading through 'r', which takes a reference to 'map'. */
+static AVIOContext *mmap_avio(MmapReader *r, MappedFile *map) {
+    AVIOContext *pb;
+    uint8_t *buf;
+
+    memset(r, 0, sizeof(*r));
+    buf = (uint8_t *)av_malloc(AVIO_BUFFER_SIZE);
+    pb = buf ? avio_alloc_context(buf, AVIO_BUFFER_SIZE, 0, r, mmap_read, NULL, mmap_seek) : NULL;
+    if(!pb) {
+        av_free(buf);
+        return NULL;
+    }
+    /* reads of a whole packet go straight to mmap_read, not through buf */
+    pb->direct = 1;
+    r->map = mapped_file_ref(map);
+    return pb;
+}
+
+/* free an AVIOContext of ours, after avformat_close_input */
+static void input_avio_free(AVIOContext *pb) {
+    if(pb) {
+        av_free(pb->buffer);
+        av_free(pb);
+    }
+}
+
+/* Give the demuxer a read-ahead or memory mapped AVIOContext, NULL to
+   leave the I/O to FFmpeg. Read-ahead fills the ring with tasks on 'exec'. */
+static AVIOContext *input_avio(VideoState *is, Executor *exec) {
+    AVIOContext *pb;
+    MappedFile *map;
+    uint8_t *buf;
+
+    if(is->opts.mmap_input) {
+        map = mapped_file_open(is->filename);
+        if(map) {
+            pb = mmap_avio(&is->mmap_reader, map);
+            mapped_file_unref(map);
+            if(pb) {
+                return pb;
+            }
+        }
+    }
+    if(is->opts.readahead_kb <= 0 ||
+       readahead_open(&is->readahead, is->filename, is->opts.readahead_kb * 1024, exec) < 0) {
+        return NULL;
+    }
+    buf = (uint8_t *)av_malloc(AVIO_BUFFER_SIZE);
+    pb = buf ? avio_alloc_context(buf, AVIO_BUFFER_SIZE, 0, &is->readahead,
+                                  readahead_read, NULL, readahead_seek) : NULL;
+    if(!pb) {
+        av_free(buf);
+        readahead_close(&is->readahead);
+    }
+    return pb;
+}
+
+int decode_interrupt_cb(void *opaque) {
+    VideoState *is = (VideoState *)opaque;
+
+    return (is && is->quit);
+}
+
+static int keyframe_index_add(KeyframeIndex *idx, int64_t pts, int64_t pos) {
+    int64_t *p;
+
+    if(idx->nb_entries >= idx->nb_allocated) {
+        int n = FFMAX(2 * idx->nb_allocated, 1024);
+
+        if(!(p = (int64_t *)av_realloc(idx->pts, n * sizeof(*p)))) {
+            return -1;
+        }
+        idx->pts = p;
+        if(!(p = (int64_t *)av_realloc(idx->pos, n * sizeof(*p)))) {
+            return -1;
+        }
+        idx->pos = p;
+        idx->nb_allocated = n;
+    }
+    idx->pts[idx->nb_entries] = pts;
+    idx->pos[idx->nb_entries] = pos;
+    idx->nb_entries++;
+    return 0;
+}
+
+/* Background task: scan the file on a separate demuxer for video
+   keyframes, without decoding anything. */
+static void keyframe_index_run(void *arg, ExecWorker *w) {
+    VideoState *is = (VideoState *)arg;
+    KeyframeIndex *idx = &is->kf_index;
+    AVFormatContext *ic = avformat_alloc_context();
+    MmapReader reader;
+    AVIOContext *pb = NULL;
+    AVPacket pkt;
+    int64_t pts;
+
+    ic->interrupt_callback.callback = decode_interrupt_cb;
+    ic->interrupt_callback.opaque = is;
+    if(is->mmap_reader.map) {
+        /* scan the mapping the demux stage reads too, no second open */
+        pb = mmap_avio(&reader, is->mmap_reader.map);
+        ic->pb = pb;
+    }
+    if(avformat_open_input(&ic, is->filename, NULL, NULL) != 0) {
+        input_avio_free(pb);
+        if(pb) {
+            mapped_file_unref(reader.map);
+        }
+        return;
+    }
+    while(!is->quit && av_read_frame(ic, &pkt) >= 0) {
+        pts = pkt.pts != AV_NOPTS_VALUE ? pkt.pts : pkt.dts;
+        if(pkt.stream_index == is->videoStream && (pkt.flags & AV_PKT_FLAG_KEY) &&
+           pts != AV_NOPTS_VALUE && pkt.pos >= 0) {
+            SDL_LockMutex(idx->mutex);
+            if(!idx->nb_entries || pts > idx->last_pts) {
+                keyframe_index_add(idx, pts, pkt.pos);
+                idx->last_pts = pts;
+            }
+            SDL_UnlockMutex(idx->mutex);
+        }
+        av_free_packet(&pkt);
+    }
+    idx->complete = !is->quit;
+    avformat_close_input(&ic);
+    if(pb) {
+        input_avio_free(pb);
+        mapped_file_unref(reader.map);
+    }
+}
+
+/* Byte position of the last keyframe at or before 'pts', -1 if the index
+   does not cover it (yet). */
+static int64_t keyframe_index_lookup(KeyframeIndex *idx, int64_t pts) {
+    int64_t pos = -1;
+    int lo = 0, hi, mid;
+
+    if(!idx->mutex) {
+        return -1;
+    }
+    SDL_LockMutex(idx->mutex);
+    hi = idx->nb_entries - 1;
+    if(hi >= 0 && (idx->complete || pts <= idx->last_pts)) {
+        while(lo < hi) {
+            mid = (lo + hi + 1) / 2;
+            if(idx->pts[mid] <= pts) {
+                lo = mid;
+            } else {
+                hi = mid - 1;
+            }
+        }
+        pos = idx->pos[lo];
+    }
+    SDL_UnlockMutex(idx->mutex);
+    return pos;
+}
+
+/* Ask the demux stage to seek to 'pos' (AV_TIME_BASE). Callable from any
+   thread, a request that did not start yet is replaced by the new one. */
+void stream_seek(VideoState *is, int64_t pos) {
+    AVFormatContext *ic = is->pFormatCtx;
+    int64_t start;
+
+    /* keep the target inside the file, av_seek_frame fails outside it */
+    if(ic) {
+        start = ic->start_time != AV_NOPTS_VALUE ? ic->start_time : 0;
+        if(ic->duration != AV_NOPTS_VALUE && ic->duration > 0) {
+            pos = FFMIN(pos, start + ic->duration);
+        }
+        pos = FFMAX(pos, start);
+    }
+    SDL_LockMutex(is->seek_mutex);
+    is->seek_pos = pos;
+    is->seek_req = 1;
+    SDL_UnlockMutex(is->seek_mutex);
+    /* don't let demux wait for the queues to drain first */
+    stage_wake(&is->demux_stage);
+}
+
+/* Seek demux to the keyframe before the target, through our own index on
+   files that have none, then flush the queues. The decoders skip forward
+   from the keyframe to the target. */
+static void decode_seek(VideoState *is) {
+    AVFormatContext *ic = is->pFormatCtx;
+    AVRational tb = { 1, AV_TIME_BASE };
+    int64_t target, pos;
+    int ret;
+
+    SDL_LockMutex(is->seek_mutex);
+    target = is->seek_pos;
+    is->seek_req = 0;
+    SDL_UnlockMutex(is->seek_mutex);
+
+    pos = keyframe_index_lookup(&is->kf_index,
+                                av_rescale_q(target, tb, is->video_st->time_base));
+    if(pos >= 0) {
+        ret = av_seek_frame(ic, is->videoStream, pos, AVSEEK_FLAG_BYTE);
+    } else {
+        ret = av_seek_frame(ic, -1, target, AVSEEK_FLAG_BACKWARD);
+    }
+    if(ret < 0) {
+        fprintf(stderr, "%s: error while seeking\n", is->filename);
+        return;
+    }
+    packet_queue_flush(&is->audioq, target);
+    packet_queue_flush(&is->videoq, target);
+    is->eof = 0;
+
+    /* without an index the demuxer has to search for every seek, so build
+       one in the background for the next ones */
+    if(!is->kf_index.mutex && !is->video_st->nb_index_entries &&
+       !(ic->iformat->flags & AVFMT_NO_BYTE_SEEK) && is->player->exec->nb_workers > 1) {
+        is->kf_index.mutex = SDL_CreateMutex();
+        executor_submit(is->player->exec, TASK_PRIO_BACKGROUND, keyframe_index_run, is);
+    }
+}
+
+/* The session ends: have the main thread close it, or the null sink
+   notice. */
+static int stream_finish(VideoState *is) {
+    Player *pl = is->player;
+
+    if(pl->headless) {
+        /* no event loop, wake the null sink instead */
+        is->quit = 1;
+        player_wake(pl);
+    } else {
+        SDL_Event event;
+        event.type = FF_QUIT_EVENT;
+        event.user.data1 = is;
+        SDL_PushEvent(&event);
+    }
+    return STEP_DONE;
+}
+
+/* a codec open of the demux stage finished, the last one wakes it */
+static void stream_codec_opened(VideoState *is) {
+    if(!__sync_sub_and_fetch(&is->opens_pending, 1)) {
+        stage_wake(&is->demux_stage);
+    }
+}
+
+/* Audio open stage: stream_component_open next to the video codec's, to
+   open the codecs in parallel. */
+static int audio_open_step(VideoState *is) {
+    is->audio_open_ret = stream_component_open(is, is->audioStream);
+    stream_codec_opened(is);
+    return STEP_DONE;
+}
+
+/* Main loop of the demux stage: read one packet into its queue, parking
+   while a queue is full, until the session closes. */
+static int demux_step(VideoState *is) {
+    AVFormatContext *pFormatCtx = is->pFormatCtx;
+    AVPacket pkt1, *packet = &pkt1;
+    int ret;
+
+    if(is->quit) {
+        return stream_finish(is);
+    }
+    if(is->read_error) {
+        /* nothing more to read, wait for the user to quit */
+        return STEP_PARKED;
+    }
+    /* every put below needs a free slot */
+    if(is->audioq.consumer &&
+       is->audioq.windex - is->audioq.rindex >= PACKET_QUEUE_SIZE) {
+        return packet_queue_park(&is->audioq, PACKET_QUEUE_WAIT_SLOT) ? STEP_AGAIN : STEP_PARKED;
+    }
+    if(is->videoq.consumer &&
+       is->videoq.windex - is->videoq.rindex >= PACKET_QUEUE_SIZE) {
+        return packet_queue_park(&is->videoq, PACKET_QUEUE_WAIT_SLOT) ? STEP_AGAIN : STEP_PARKED;
+    }
+    if(is->seek_req) {
+        decode_seek(is);
+        return STEP_AGAIN;
+    }
+    /* park until the consumer drained the full queue to its low-water mark */
+    if(packet_queue_full(&is->audioq)) {
+        return packet_queue_park(&is->audioq, PACKET_QUEUE_WAIT_SPACE) ? STEP_AGAIN : STEP_PARKED;
+    }
+    if(packet_queue_full(&is->videoq)) {
+        return packet_queue_park(&is->videoq, PACKET_QUEUE_WAIT_SPACE) ? STEP_AGAIN : STEP_PARKED;
+    }
+    if(is->eof) {
+        /* the consumers drain, wait for user input; stream_seek wakes us */
+        return STEP_PARKED;
+    }
+    PROBE_START(start);
+    ret = av_read_frame(is->pFormatCtx, packet);
+    PROBE_END(is, PROBE_DEMUX, start);
+    if(ret < 0) {
+        if(ret == AVERROR_EOF || !pFormatCtx->pb || url_feof(pFormatCtx->pb) ||
+           pFormatCtx->pb->error == 0) {
+            /* no error; let the consumers drain */
+            packet_queue_put_eof(&is->videoq, is->videoStream);
+            packet_queue_put_eof(&is->audioq, is->audioStream);
+            is->eof = 1;
+        } else {
+            is->read_error = 1;
+        }
+        return STEP_AGAIN;
+    }
+    // Is this a packet from the video stream?
+    if(packet->stream_index == is->videoStream) {
+        PROBE_START(put_start);
+        packet_queue_put(&is->videoq, packet);
+        PROBE_END(is, PROBE_PACKET_PUT, put_start);
+        // Is this a packet from the audio stream?
+    } else if(packet->stream_index == is->audioStream) {
+        PROBE_START(put_start);
+        packet_queue_put(&is->audioq, packet);
+        PROBE_END(is, PROBE_PACKET_PUT, put_start);
+    } else {
+        av_free_packet(packet);
+        return STEP_AGAIN;
+    }
+    PROBE_VALUE(is, PROBE_AUDIOQ_PACKETS, is->audioq.nb_packets);
+    PROBE_VALUE(is, PROBE_AUDIOQ_BYTES, is->audioq.size);
+    PROBE_VALUE(is, PROBE_VIDEOQ_PACKETS, is->videoq.nb_packets);
+    PROBE_VALUE(is, PROBE_VIDEOQ_BYTES, is->videoq.size);
+    return STEP_AGAIN;
+}
+
+/* Demux stage once both codecs are open, or failed to. */
+static int stream_opened_step(VideoState *is) {
+    if(is->opens_pending) {
+        /* stream_codec_opened wakes us */
+        return STEP_PARKED;
+    }
+    is->codecs_time = clock_monotonic_us();
+
+    // Dump information about file onto standard error
+    av_dump_format(is->pFormatCtx, 0, is->filename, 0);
+
+    if(is->audio_open_ret < 0 || is->video_open_ret < 0) {
+        fprintf(stderr, "%s: could not open codecs\n", is->filename);
+        //cerr << "could not open codecs\n " << is->filename;
+        return stream_finish(is);
+    }
+    is->demux_stage.step = demux_step;
+    return STEP_AGAIN;
+}
+
+/* First step of the demux stage: open the input and its codecs. */
+static int stream_open_step(VideoState *is) {
+
+    AVFormatContext *pFormatCtx;
+    AVIOContext *pb;
+    Player *pl = is->player;
+
+    int video_index = -1;
+    int audio_index = -1;
+    int i;
+
+    is->videoStream=-1;
+    is->audioStream=-1;
+
+    pFormatCtx = avformat_alloc_context();
+    // will interrupt blocking functions if we quit!
+    pFormatCtx->interrupt_callback.callback = decode_interrupt_cb;
+    pFormatCtx->interrupt_callback.opaque = is;
+    pb = pFormatCtx->pb = input_avio(is, pl->exec);
+    /* bound the probing, most containers say everything in their header */
+    if(is->opts.probe_size > 0) {
+        pFormatCtx->probesize = is->opts.probe_size;
+    }
+    if(is->opts.analyze_ms > 0) {
+        pFormatCtx->max_analyze_duration = (int)((int64_t)is->opts.analyze_ms * AV_TIME_BASE / 1000);
+    }
+
+    // Open video file
+    if(avformat_open_input(&pFormatCtx, is->filename, NULL, NULL)!=0) {
+        /* the context is gone, a pb of ours is left to us */
+        input_avio_free(pb);
+        return stream_finish(is); // Couldn't open file
+    }
+
+    is->pFormatCtx = pFormatCtx;
+
+    // Retrieve stream information
+    if(avformat_find_stream_info(pFormatCtx, NULL)<0) {
+        avformat_close_input(&is->pFormatCtx);
+        input_avio_free(pb);
+        return stream_finish(is); // Couldn't find stream information
+    }
+    is->probe_time = clock_monotonic_us();
+
+    // Find the first video and audio stream
+
+    for(i=0; i<(int)pFormatCtx->nb_streams; i++) {
+        if(pFormatCtx->streams[i]->codec->codec_type==AVMEDIA_TYPE_VIDEO &&
+           video_index < 0) {
+            video_index=i;
+        }
+        if(pFormatCtx->streams[i]->codec->codec_type==AVMEDIA_TYPE_AUDIO &&
+           audio_index < 0) {
+            audio_index=i;
+        }
+    }
+
+    /* the audio codec and device open meanwhile, on another worker */
+    is->audio_open_ret = is->video_open_ret = -1;
+    is->opens_pending = 1;
+    if(audio_index >= 0) {
+        is->opens_pending++;
+        is->audioStream = audio_index;
+        stage_start(&is->audio_open_stage, pl->exec, is, audio_open_step);
+    }
+
+    // Make a screen to put our video, sessions sharing it keep the grid main set up
+    if(video_index >= 0 && !pl->headless && pl->nb_sessions == 1) {
+        /* SDL wants video calls on the main thread, have it open the window */
+        SDL_Event event;
+        event.type = FF_WINDOW_EVENT;
+        event.user.code = video_index;
+        event.user.data1 = is;
+        SDL_PushEvent(&event);
+    }
+
+    if(video_index >= 0) {
+        is->video_open_ret = stream_component_open(is, video_index);
+    }
+    is->demux_stage.step = stream_opened_step;
+    stream_codec_opened(is);
+    return STEP_AGAIN;
+}
+
+/* schedule the next video refresh in 'delay' microseconds, see presentation_loop */
+static void schedule_refresh(VideoState *is, int64_t delay) {
+    is->refresh_deadline = clock_monotonic_us() + delay;
+}
+
+/* Record and report the time to the first picture shown, or taken by the
+   headless sink. */
+static void stream_first_frame(VideoState *is) {
+    int64_t now = clock_monotonic_us();
+
+    if(is->first_frame_time) {
+        return;
+    }
+    is->first_frame_time = now;
+    fprintf(stderr, "%s: first frame after %d ms (probe %d ms, codecs %d ms)\n", is->filename,
+            (int)((now - is->open_time) / 1000), (int)((is->probe_time - is->open_time) / 1000),
+            (int)((is->codecs_time - is->probe_time) / 1000));
+}
+
+/* Copy a picture into the display overlay, (re)creating the overlay first
+   if the geometry changed. Must run on the main thread. This is the one
+   copy of a directly rendered picture: an SDL 1.2 overlay owns its pixels
+   and can't show the decoder's buffer in place. */
+static int video_upload(VideoState *is, VideoPicture *vp) {
+
+    AVPicture pict;
+
+    if(!is->bmp || is->bmp->w != vp->width || is->bmp->h != vp->height) {
+        if(is->bmp) {
+            // we already have one make another, bigger/smaller
+            SDL_FreeYUVOverlay(is->bmp);
+        }
+        // Allocate a place to put our YUV image on that screen
+        is->bmp = SDL_CreateYUVOverlay(vp->width, vp->height,
+                                       SDL_YV12_OVERLAY, is->player->screen);
+        if(!is->bmp) {
+            return -1;
+        }
+    }
+
+    SDL_LockYUVOverlay(is->bmp);
+    /* point pict at the overlay, YV12 stores V before U */
+    pict.data[0] = is->bmp->pixels[0];
+    pict.data[1] = is->bmp->pixels[2];
+    pict.data[2] = is->bmp->pixels[1];
+
+    pict.linesize[0] = is->bmp->pitches[0];
+    pict.linesize[1] = is->bmp->pitches[2];
+    pict.linesize[2] = is->bmp->pitches[1];
+
+    av_picture_copy(&pict, &vp->pict, PIX_FMT_YUV420P, vp->width, vp->height);
+    SDL_UnlockYUVOverlay(is->bmp);
+    return 0;
+}
+
+/* The part of the window session 'index' of 'nb' draws into: all of it
+   for one session, otherwise a cell of the most square grid. */
+static void player_session_rect(Player *pl, int index, int nb, SDL_Rect *cell) {
+
+    int cols, rows;
+
+    if(nb <= 1) {
+        cols = rows = 1;
+    } else {
+        cols = (int)ceil(sqrt((double)nb));
+        rows = (nb + cols - 1) / cols;
+    }
+    cell->w = pl->screen->w / cols;
+    cell->h = pl->screen->h / rows;
+    cell->x = index % cols * cell->w;
+    cell->y = index / cols * cell->h;
+}
+
+void video_display(VideoState *is) {
+
+    SDL_Rect rect, cell;
+    VideoPicture *vp;
+    float aspect_ratio;
+    int w, h, x, y;
+
+    PROBE_START(start);
+
+    vp = &is->pictq[is->pictq_rindex];
+    if(video_upload(is, vp) == 0) {
+        if(is->video_st->codec->sample_aspect_ratio.num == 0) {
+            aspect_ratio = 0;
+        } else {
+            aspect_ratio = av_q2d(is->video_st->codec->sample_aspect_ratio) *
+                           is->video_st->codec->width / is->video_st->codec->height;
+        }
+        if(aspect_ratio <= 0.0) {
+            aspect_ratio = (float)is->video_st->codec->width /
+                           (float)is->video_st->codec->height;
+        }
+        player_session_rect(is->player, is->index, is->player->nb_sessions, &cell);
+        h = cell.h;
+        w = ((int)rint(h * aspect_ratio)) & -3;
+        if(w > cell.w) {
+            w = cell.w;
+            h = ((int)rint(w / aspect_ratio)) & -3;
+        }
+        x = cell.x + (cell.w - w) / 2;
+        y = cell.y + (cell.h - h) / 2;
+
+        rect.x = x;
+        rect.y = y;
+        rect.w = w;
+        rect.h = h;
+        SDL_DisplayYUVOverlay(is->bmp, &rect);
+        stream_first_frame(is);
+    }
+    PROBE_END(is, PROBE_DISPLAY, start);
+#if ENABLE_PROBES
+    {
+        int64_t now = clock_monotonic_us();
+
+        PROBE_VALUE(is, PROBE_PRESENT_LATE, FFMAX(now - is->present_deadline, 0));
+        if(is->last_present) {
+            PROBE_VALUE(is, PROBE_FRAME_INTERVAL, now - is->last_present);
+        }
+        is->last_present = now;
+    }
+#endif
+}
+
+/* release the displayed picture back to the decoder */
+static void pictq_next_picture(VideoState *is) {
+    VideoPicture *vp = &is->pictq[is->pictq_rindex];
+
+    if(vp->fb) {
+        frame_buffer_unref(vp->fb);
+        vp->fb = NULL;
+    }
+    if(++is->pictq_rindex == is->pictq_depth) {
+        is->pictq_rindex = 0;
+    }
+    SDL_LockMutex(is->pictq_mutex);
+    is->pictq_size--;
+    SDL_UnlockMutex(is->pictq_mutex);
+    /* pictq_size before pictq_waiting, see pictq_park */
+    __sync_synchronize();
+    if(is->pictq_waiting && __sync_bool_compare_and_swap(&is->pictq_waiting, 1, 0)) {
+        stage_wake(&is->video_stage);
+    }
+}
+
+void video_refresh_timer(void *userdata) {
+
+    VideoState *is = (VideoState *)userdata;
+    VideoPicture *vp, *nextvp;
+    double actual_delay, delay, sync_threshold, ref_clock, diff, duration;
+    int first;
+
+    if(is->video_st) {
+retry:
+        PROBE_VALUE(is, PROBE_PICTQ_SIZE, is->pictq_size);
+        if(is->pictq_size == 0) {
+            /* presentation_loop waits for the next picture */
+            schedule_refresh(is, 0);
+        } else {
+            vp = &is->pictq[is->pictq_rindex];
+
+            if(vp->serial != is->videoq.serial) {
+                /* decoded before a seek */
+                pictq_next_picture(is);
+                goto retry;
+            }
+            first = vp->serial != is->frame_serial;
+            if(first) {
+                /* first picture after opening or a seek: restart the frame
+                   timer, and show it right away instead of syncing it to a
+                   master clock that may not run yet */
+                is->frame_serial = vp->serial;
+                is->frame_timer = clock_monotonic_us() / 1000000.0;
+                is->frame_last_pts = vp->pts;
+            }
+
+            clock_set(&is->vidclk, vp->pts);
+            clock_sync_to_slave(&is->extclk, &is->vidclk);
 
             delay = vp->pts - is->frame_last_pts; /* the pts from last time */
             if(delay <= 0 || delay >= 1.0) {
@@ -857,144 +3760,1197 @@ void video_refresh_timer(void *userdata) {
             is->frame_last_delay = delay;
             is->frame_last_pts = vp->pts;
 
-            /* update delay to sync to audio if not master source */
-            if(is->av_sync_type != AV_SYNC_VIDEO_MASTER) {
-                ref_clock = get_master_clock(is);
-                diff = vp->pts - ref_clock;
+            /* in sync unless the master clock says otherwise */
+            diff = 0;
+            sync_threshold = AV_SYNC_THRESHOLD;
+
+            /* update delay to sync to audio if not master source */
+            ref_clock = NAN;
+            if(is->av_sync_type != AV_SYNC_VIDEO_MASTER && !first) {
+                ref_clock = get_master_clock(is);
+            }
+            /* the master clock is unset until audio starts, keep the pace */
+            if(!isnan(ref_clock)) {
+                diff = vp->pts - ref_clock;
+
+                /* Skip or repeat the frame. Take delay into account
+           FFPlay still doesn't "know if this is the best guess." */
+                sync_threshold = (delay > AV_SYNC_THRESHOLD) ? delay : AV_SYNC_THRESHOLD;
+                PROBE_VALUE(is, PROBE_AV_DIFF, (int64_t)(fabs(diff) * 1000000.0));
+                if(fabs(diff) < AV_NOSYNC_THRESHOLD) {
+                    if(diff <= -sync_threshold) {
+                        delay = 0;
+                    } else if(diff >= sync_threshold) {
+                        /* video is ahead, show this picture twice as long */
+                        delay = 2 * delay;
+                        is->frame_repeats++;
+                    }
+                }
+            }
+
+            /* delay is media time, at another speed it lasts longer or shorter */
+            is->frame_timer += delay / is->speed;
+
+            /* if the picture is behind the master clock or the next queued
+               picture is due already, this one is late: drop it */
+            if(is->pictq_size > 1 && !first) {
+                nextvp = &is->pictq[(is->pictq_rindex + 1) % is->pictq_depth];
+                duration = nextvp->pts - vp->pts;
+                if((is->av_sync_type != AV_SYNC_VIDEO_MASTER &&
+                    diff <= -sync_threshold && fabs(diff) < AV_NOSYNC_THRESHOLD) ||
+                   (duration > 0 && clock_monotonic_us() / 1000000.0 > is->frame_timer + duration / is->speed)) {
+                    is->frame_drops_late++;
+                    pictq_next_picture(is);
+                    goto retry;
+                }
+            }
+
+            /* computer the REAL delay */
+            actual_delay = is->frame_timer - (clock_monotonic_us() / 1000000.0);
+            if(actual_delay < 0) {
+                /* late pictures were dropped above, this is the last one
+                   queued so show the next one right when it arrives */
+                actual_delay = 0;
+            }
+            schedule_refresh(is, (int64_t)(actual_delay * 1000000.0));
+
+            /* show the picture! */
+            video_display(is);
+
+            /* update queue for next picture! */
+            pictq_next_picture(is);
+        }
+    } else {
+        schedule_refresh(is, 100000);
+    }
+}
+
+
+
+#if ENABLE_PROBES
+static const char *const probe_names[PROBE_NB] = {
+    "demux", "packet_put", "videoq_get", "video_decode", "convert",
+    "audioq_get", "audio_decode", "audio_callback", "display",
+    "audioq_packets", "audioq_bytes", "videoq_packets", "videoq_bytes",
+    "pictq_size", "av_diff", "present_late", "frame_interval",
+};
+#endif
+
+/* open the -stats output, if any */
+int probes_open(VideoState *is) {
+    Probes *pr = &is->probes;
+    char path[1024];
+
+    pr->start = pr->last_dump = av_gettime();
+    pr->format = is->opts.stats_format && !strcmp(is->opts.stats_format, "csv") ?
+                 PROBES_FORMAT_CSV : PROBES_FORMAT_JSON;
+    if(!is->opts.stats_file) {
+        return 0;
+    }
+    /* one file per session, suffixed with its index when there are several */
+    if(is->player->nb_sessions > 1) {
+        snprintf(path, sizeof(path), "%s.%d", is->opts.stats_file, is->index);
+    } else {
+        snprintf(path, sizeof(path), "%s", is->opts.stats_file);
+    }
+    if(!strcmp(is->opts.stats_file, "-")) {
+        pr->out = stderr;
+    } else if(!(pr->out = fopen(path, "w"))) {
+        fprintf(stderr, "%s: could not open stats file\n", path);
+        return -1;
+    }
+    if(pr->format == PROBES_FORMAT_CSV) {
+        fprintf(pr->out, "time,name,count,mean,p50,p90,p99,max\n");
+    }
+    return 0;
+}
+
+/* Write one snapshot: a JSON object per line, or one CSV row per probe and
+   counter. The histograms are read while the other threads keep recording,
+   so a snapshot may be off by the few values added meanwhile. */
+void probes_dump(VideoState *is) {
+    Probes *pr = &is->probes;
+    double t = (av_gettime() - pr->start) / 1000000.0;
+    const char *counter_names[] = {
+        "video_frames", "audio_frames", "frames_dropped", "packets_dropped",
+        "nonref_skipped", "frames_repeated", "audio_underruns",
+        "audio_ring_min_ms", "audio_ring_avg_ms", "pts_errors",
+        "audio_drift_ppm", "first_frame_ms",
+    };
+    PcmRing *ring = &is->audio_ring;
+    int ring_samples = ring->fill_samples;
+    int counters[] = {
+        (int)pr->video_frames, (int)pr->audio_frames, is->frame_drops_late,
+        is->frame_drops_packets, is->frame_skips_nonref, is->frame_repeats,
+        ring->underruns,
+        ring_samples ? (int)(ring->fill_min * (int64_t)1000 / is->audio_bytes_per_sec) : -1,
+        ring_samples ? (int)(ring->fill_total * 1000 / ring_samples / is->audio_bytes_per_sec) : -1,
+        is->video_pts_errors,
+        (int)(clock_get_drift(&is->audclk) * 1000000.0),
+        is->first_frame_time ? (int)((is->first_frame_time - is->open_time) / 1000) : -1,
+    };
+    int i, n = sizeof(counters) / sizeof(counters[0]);
+
+    if(!pr->out) {
+        return;
+    }
+    if(pr->format == PROBES_FORMAT_JSON) {
+        fprintf(pr->out, "{\"time\":%.3f", t);
+    }
+#if ENABLE_PROBES
+    for(i = 0; i < PROBE_NB; i++) {
+        Histogram *h = &pr->hist[i];
+        double mean = h->count ? (double)h->total / h->count : 0.0;
+
+        if(pr->format == PROBES_FORMAT_CSV) {
+            fprintf(pr->out, "%.3f,%s,%u,%.1f,%d,%d,%d,%d\n", t, probe_names[i], h->count, mean,
+                    (int)hist_percentile(h, 50), (int)hist_percentile(h, 90),
+                    (int)hist_percentile(h, 99), (int)h->max);
+        } else {
+            fprintf(pr->out, ",\"%s\":{\"count\":%u,\"mean\":%.1f,\"p50\":%d,\"p90\":%d,\"p99\":%d,\"max\":%d}",
+                    probe_names[i], h->count, mean,
+                    (int)hist_percentile(h, 50), (int)hist_percentile(h, 90),
+                    (int)hist_percentile(h, 99), (int)h->max);
+        }
+    }
+#endif
+    for(i = 0; i < n; i++) {
+        if(pr->format == PROBES_FORMAT_CSV) {
+            fprintf(pr->out, "%.3f,%s,%d,,,,,\n", t, counter_names[i], counters[i]);
+        } else {
+            fprintf(pr->out, ",\"%s\":%d", counter_names[i], counters[i]);
+        }
+    }
+    if(pr->format == PROBES_FORMAT_JSON) {
+        fprintf(pr->out, "}\n");
+    }
+    fflush(pr->out);
+    pr->last_dump = av_gettime();
+}
+
+/* periodic dump, called from the main thread */
+void probes_tick(VideoState *is) {
+    Probes *pr = &is->probes;
+
+    if(pr->out && is->opts.stats_interval > 0 &&
+       av_gettime() - pr->last_dump >= is->opts.stats_interval * (int64_t)1000) {
+        probes_dump(is);
+    }
+}
+
+void probes_close(VideoState *is) {
+    Probes *pr = &is->probes;
 
-                /* Skip or repeat the frame. Take delay into account
-           FFPlay still doesn't "know if this is the best guess." */
-                sync_threshold = (delay > AV_SYNC_THRESHOLD) ? delay : AV_SYNC_THRESHOLD;
-                if(fabs(diff) < AV_NOSYNC_THRESHOLD) {
-                    if(diff <= -sync_threshold) {
-                        delay = 0;
-                    } else if(diff >= sync_threshold) {
-                        delay = 2 * delay;
-                    }
-                }
-            }
+    if(pr->out) {
+        probes_dump(is);
+        if(pr->out != stderr) {
+            fclose(pr->out);
+        }
+        pr->out = NULL;
+    }
+}
 
-            is->frame_timer += delay;
-            /* computer the REAL delay */
-            actual_delay = is->frame_timer - (av_gettime() / 1000000.0);
-            if(actual_delay < 0.010) {
-                /* Really it should skip the picture instead */
-                actual_delay = 0.010;
-            }
-            schedule_refresh(is, (int)(actual_delay * 1000 + 0.5));
+/* Human readable summary for -headless. Throughput of a stage is counted
+   against the time spent in it, so it is what the stage could sustain on
+   its own. */
+static void probes_print(VideoState *is, int64_t elapsed) {
+    Probes *pr = &is->probes;
+#if ENABLE_PROBES
+    static const int stages[] = {
+        PROBE_DEMUX, PROBE_VIDEO_DECODE, PROBE_CONVERT, PROBE_AUDIO_DECODE,
+    };
+    unsigned int i;
+
+    for(i = 0; i < sizeof(stages) / sizeof(stages[0]); i++) {
+        Histogram *h = &pr->hist[stages[i]];
+
+        fprintf(stderr, "%-13s %8u calls %10.1f/s  p50 %6dus  p90 %6dus  p99 %6dus  max %6dus\n",
+                probe_names[stages[i]], h->count,
+                h->total ? h->count * 1000000.0 / h->total : 0.0,
+                (int)hist_percentile(h, 50), (int)hist_percentile(h, 90),
+                (int)hist_percentile(h, 99), (int)h->max);
+    }
+#endif
+    fprintf(stderr, "total         %8u video frames %u audio frames in %.3fs, %.1f video frames/s\n",
+            pr->video_frames, pr->audio_frames, elapsed / 1000000.0,
+            pr->video_frames * 1000000.0 / FFMAX(elapsed, 1));
+    if(is->mmap_reader.map) {
+        fprintf(stderr, "mmap input    %8d KB copied out of the mapping\n",
+                (int)(is->mmap_reader.bytes_copied / 1024));
+    } else if(is->readahead.mutex) {
+        fprintf(stderr, "read-ahead    %8d KB read, %d KB copied out, %d demuxer reads waited for the disk\n",
+                (int)(is->readahead.bytes_read / 1024), (int)(is->readahead.bytes_copied / 1024),
+                is->readahead.stalls);
+    }
+    fprintf(stderr, "packets       %8d payloads copied again on queueing, %d KB\n",
+            is->audioq.copies + is->videoq.copies,
+            (int)((is->audioq.bytes_copied + is->videoq.bytes_copied) / 1024));
+    fprintf(stderr, "packet pool   %8d hits %d misses %d over the cap, peak %d KB of %d KB\n",
+            is->packet_pool.hits, is->packet_pool.misses, is->packet_pool.capped,
+            (int)(is->packet_pool.peak_bytes / 1024), (int)(is->packet_pool.max_bytes / 1024));
+}
 
-            /* show the picture! */
-            video_display(is);
+/* Change the playback speed, main thread only. Audio is time stretched to
+   it, the clocks run at it. */
+void stream_set_speed(VideoState *is, double speed) {
+    is->speed = FFMAX(FFMIN(speed, SPEED_MAX), SPEED_MIN);
+    clock_set_speed(&is->vidclk, is->speed);
+    clock_set_speed(&is->extclk, is->speed);
+    SDL_LockAudio();
+    clock_set_speed(&is->audclk, is->speed);
+    SDL_UnlockAudio();
+}
 
-            /* update queue for next picture! */
-            if(++is->pictq_rindex == VIDEO_PICTURE_QUEUE_SIZE) {
-                is->pictq_rindex = 0;
-            }
-            SDL_LockMutex(is->pictq_mutex);
-            is->pictq_size--;
-            SDL_CondSignal(is->pictq_cond);
-            SDL_UnlockMutex(is->pictq_mutex);
+/* next step of the speed control, 'dir' is 1 for faster and -1 for slower */
+static double speed_step(double speed, int dir) {
+    static const double steps[] = { 0.25, 0.5, 0.75, 1.0, 1.25, 1.5, 2.0, 3.0, 4.0 };
+    int i, n = sizeof(steps) / sizeof(steps[0]);
+
+    if(dir > 0) {
+        for(i = 0; i < n - 1 && steps[i] <= speed + 1e-6; i++) {
         }
     } else {
-        schedule_refresh(is, 100);
+        for(i = n - 1; i > 0 && steps[i] >= speed - 1e-6; i--) {
+        }
+    }
+    return steps[i];
+}
+
+/* Pause or resume playback, main thread only. The device keeps running for
+   the other sessions, the callback just stops mixing this one. */
+void stream_toggle_pause(VideoState *is) {
+    if(is->paused) {
+        /* the time spent paused must not count as late */
+        is->frame_timer += clock_now() - is->vidclk.last_updated;
     }
+    clock_set_paused(&is->vidclk, !is->paused);
+    clock_set_paused(&is->extclk, !is->paused);
+    /* the callback writes audclk too */
+    SDL_LockAudio();
+    is->paused = !is->paused;
+    clock_set_paused(&is->audclk, is->paused);
+    SDL_UnlockAudio();
 }
 
+/* Stop all stages of a session, from any thread. They end on their own,
+   nothing is freed. */
+void stream_close(VideoState *is) {
+    is->quit = 1;
+    packet_queue_abort(&is->audioq);
+    packet_queue_abort(&is->videoq);
+    pcm_ring_abort(&is->audio_ring);
+    readahead_abort(&is->readahead);
+    stage_wake(&is->demux_stage);
+    stage_wake(&is->video_stage);
+    stage_wake(&is->audio_stage);
+    player_wake(is->player);
+}
 
-int main (int argc, char *argv[]) {
+/* Wait for the stages of a closed session to end, and for the read-ahead
+   tasks they left. Needs the executor still running. */
+static void stream_wait(VideoState *is) {
+    while(is->demux_stage.state != STAGE_STOPPED ||
+          is->audio_open_stage.state != STAGE_STOPPED ||
+          is->video_stage.state != STAGE_STOPPED ||
+          is->audio_stage.state != STAGE_STOPPED) {
+        SDL_Delay(1);
+    }
+    readahead_close(&is->readahead);
+}
 
-    if(argc < 2){
-        cout << "Please specify an input file\n";
-        return -1;
+/* Free a session after stream_wait, once the executor is gone too, so that
+   no keyframe index scan still reads it, and the audio device is closed.
+   Main thread only, for the overlay. */
+static void stream_free(VideoState *is) {
+    AVIOContext *pb;
+    int i;
+
+    packet_queue_free(&is->audioq);
+    packet_queue_free(&is->videoq);
+    if(is->audio_pkt.data) {
+        av_free_packet(&is->audio_pkt);
+    }
+    if(is->video_pkt.data) {
+        av_free_packet(&is->video_pkt);
+    }
+    /* the video codec hands the frame pool's buffers back on close */
+    if(is->audio_st) {
+        avcodec_close(is->audio_st->codec);
+    }
+    if(is->video_st) {
+        avcodec_close(is->video_st->codec);
+    }
+    if(is->pFormatCtx) {
+        /* our own AVIOContext outlives the demuxer, FFmpeg's does not */
+        pb = is->pFormatCtx->flags & AVFMT_FLAG_CUSTOM_IO ? is->pFormatCtx->pb : NULL;
+        avformat_close_input(&is->pFormatCtx);
+        input_avio_free(pb);
     }
+    mapped_file_unref(is->mmap_reader.map);
+    packet_pool_free(&is->packet_pool);
+
+    swr_free(&is->swr_ctx);
+    swr_free(&is->stretch_swr);
+    av_free(is->audio_frame);
+    av_free(is->video_frame);
+    av_free(is->audio_buf);
+    av_free(is->stretch_buf);
+    av_free(is->stretch.in);
+    av_free(is->stretch.mid);
+    av_free(is->stretch.out);
+    av_free(is->audio_ring.buf);
+
+    for(i = 0; i < VIDEO_PICTURE_QUEUE_SIZE_MAX; i++) {
+        if(is->pictq[i].allocated) {
+            avpicture_free(&is->pictq[i].buf);
+        }
+    }
+    for(i = 0; i < FRAME_POOL_SIZE; i++) {
+        if(is->frame_pool[i].pict.data[0]) {
+            avpicture_free(&is->frame_pool[i].pict);
+        }
+    }
+    if(is->bmp) {
+        SDL_FreeYUVOverlay(is->bmp);
+    }
+    sws_cache_free(&is->sws_cache);
+    convert_job_free(&is->convert_job);
 
-    SDL_Event event;
-    VideoState *is;
+    if(is->kf_index.mutex) {
+        av_free(is->kf_index.pts);
+        av_free(is->kf_index.pos);
+        SDL_DestroyMutex(is->kf_index.mutex);
+    }
+    SDL_DestroyMutex(is->pictq_mutex);
+    SDL_DestroyMutex(is->seek_mutex);
+    av_free(is);
+}
 
-    av_register_all();
+/* Start a session on 'filename', after the already open ones. */
+static VideoState *stream_open(Player *pl, const char *filename, const PlayerOptions *opts) {
 
-    if(SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO | SDL_INIT_TIMER)) {
-        fprintf(stderr, "Could not initialize SDL - %s\n", SDL_GetError());
-        exit(1);
+    VideoState *is;
+
+    if(pl->nb_sessions >= MAX_SESSIONS) {
+        fprintf(stderr, "%s: at most %d inputs\n", filename, MAX_SESSIONS);
+        return NULL;
+    }
+    is = (VideoState *)av_mallocz(sizeof(VideoState));
+    if(!is) {
+        return NULL;
     }
+    strncpy(is->filename, filename, sizeof(is->filename) - 1);
+    is->opts = *opts;
+    is->player = pl;
+    is->index = pl->nb_sessions;
+    is->open_time = clock_monotonic_us();
+    is->pictq_depth = av_clip(opts->pictq_depth, 1, VIDEO_PICTURE_QUEUE_SIZE_MAX);
+    /* no picture shown yet, the first one must not match any queue serial */
+    is->frame_serial = -1;
 
+    is->pictq_mutex = SDL_CreateMutex();
+    is->seek_mutex = SDL_CreateMutex();
+    convert_job_init(&is->convert_job);
+    packet_pool_init(&is->packet_pool, opts->pool_max_kb);
+
+    is->av_sync_type = sync_type_from_name(opts->sync_type);
+    clock_init(&is->audclk);
+    clock_init(&is->vidclk);
+    clock_init(&is->extclk);
+    stream_set_speed(is, opts->speed);
+    /* the audio callback walks the sessions, publish a complete one */
+    __sync_synchronize();
+    pl->sessions[pl->nb_sessions++] = is;
+    return is;
+}
+
+/* (Re)create the window, main thread only. */
+static int player_set_video_mode(Player *pl, int width, int height) {
 #ifndef __DARWIN__
-    screen = SDL_SetVideoMode(640, 480, 0, 0);
+    pl->screen = SDL_SetVideoMode(width, height, 0, 0);
 #else
-    screen = SDL_SetVideoMode(640, 480, 24, 0);
+    pl->screen = SDL_SetVideoMode(width, height, 24, 0);
 #endif
-    if(!screen) {
-        cerr << "SDL: could not set video mode - exiting\n";
-        exit(1);
-    }
+    return pl->screen ? 0 : -1;
+}
 
+/* The display scheduler, runs on the main thread because SDL 1.2 wants
+   video calls and event handling there. Sleeps on the monotonic clock until
+   the earliest refresh deadline of the sessions, or on present_cond while no
+   session has a picture, never longer than PRESENT_POLL_MS so input events
+   are still handled. Keys act on the focused session, tab moves the focus.
+   Returns on quit or once every session ended. */
+static void presentation_loop(Player *pl) {
+    SDL_Event event;
+    VideoState *is;
+    int64_t now, next;
+    double incr, pos;
+    int i, open, pending;
 
+    for(;;) {
+        while(SDL_PollEvent(&event)) {
+            is = pl->sessions[pl->focus];
+            switch(event.type) {
+            case SDL_KEYDOWN:
+                switch(event.key.keysym.sym) {
+                case SDLK_LEFT:
+                    incr = -10.0;
+                    break;
+                case SDLK_RIGHT:
+                    incr = 10.0;
+                    break;
+                case SDLK_DOWN:
+                    incr = -60.0;
+                    break;
+                case SDLK_UP:
+                    incr = 60.0;
+                    break;
+                case SDLK_SPACE:
+                    stream_toggle_pause(is);
+                    incr = 0;
+                    break;
+                case SDLK_LEFTBRACKET:
+                case SDLK_RIGHTBRACKET:
+                    stream_set_speed(is, speed_step(is->speed,
+                                                    event.key.keysym.sym == SDLK_RIGHTBRACKET ? 1 : -1));
+                    fprintf(stderr, "%s: speed %.2fx\n", is->filename, is->speed);
+                    incr = 0;
+                    break;
+                case SDLK_TAB:
+                    pl->focus = (pl->focus + 1) % pl->nb_sessions;
+                    fprintf(stderr, "focus: %s\n", pl->sessions[pl->focus]->filename);
+                    incr = 0;
+                    break;
+                default:
+                    incr = 0;
+                    break;
+                }
+                if(incr && is->video_st && !is->quit) {
+                    /* the master clock is unset until something played,
+                       there is no position to seek from yet */
+                    pos = get_master_clock(is);
+                    if(!isnan(pos)) {
+                        stream_seek(is, (int64_t)((pos + incr) * AV_TIME_BASE));
+                    }
+                }
+                break;
+            case FF_WINDOW_EVENT:
+                is = (VideoState *)event.user.data1;
+                if(player_set_video_mode(pl, is->pFormatCtx->streams[event.user.code]->codec->width,
+                                         is->pFormatCtx->streams[event.user.code]->codec->height) < 0) {
+                    fprintf(stderr, "SDL: could not set video mode - exiting\n");
+                    exit(1);
+                }
+                break;
+            case FF_QUIT_EVENT:
+                stream_close((VideoState *)event.user.data1);
+                break;
+            case SDL_QUIT:
+                return;
+            default:
+                break;
+            }
+        }
 
-    is = (VideoState *)av_mallocz(sizeof(VideoState));
+        now = clock_monotonic_us();
+        next = now + PRESENT_POLL_MS * 1000;
+        open = pending = 0;
+        for(i = 0; i < pl->nb_sessions; i++) {
+            is = pl->sessions[i];
+            /* at most PRESENT_POLL_MS after the callback made room */
+            pcm_ring_poll(&is->audio_ring);
+            if(is->quit) {
+                continue;
+            }
+            open++;
+            /* no window until the FF_WINDOW_EVENT of stream_open_step was handled */
+            if(is->paused || !is->pictq_size || !pl->screen) {
+                continue;
+            }
+            pending++;
+            if(now >= is->refresh_deadline) {
+                is->present_deadline = is->refresh_deadline;
+                video_refresh_timer(is);
+                probes_tick(is);
+            }
+            next = FFMIN(next, is->refresh_deadline);
+        }
+        if(!open) {
+            return;
+        }
+        if(pending) {
+            now = clock_monotonic_us();
+            if(next > now) {
+                clock_sleep_until(next);
+            }
+            continue;
+        }
+        /* sleep unless a session that can present got a picture meanwhile,
+           paused ones or those without a window don't count */
+        SDL_LockMutex(pl->present_mutex);
+        for(i = 0; i < pl->nb_sessions; i++) {
+            is = pl->sessions[i];
+            if(!is->quit && !is->paused && is->pictq_size && pl->screen) {
+                break;
+            }
+        }
+        if(i == pl->nb_sessions) {
+            SDL_CondWaitTimeout(pl->present_cond, pl->present_mutex, PRESENT_POLL_MS);
+        }
+        SDL_UnlockMutex(pl->present_mutex);
+    }
+}
 
-    /*
-    av_mallocz() is a nice function that will allocate memory for us and zero it out.
+/* a headless session is done once it has nothing more to give the sink */
+static int headless_done(VideoState *is) {
+    return is->quit ||
+           (!is->pictq_size && is->video_finished &&
+            (is->audioStream < 0 || is->audio_finished));
+}
 
-    Then we'll initialize our locks for the display buffer (pictq), because since the event loop
-    calls our display function - the display function, remember, will be pulling pre-decoded frames
-    from pictq. At the same time, our video decoder will be putting information into it - we don't
-    know who will get there first. Hopefully you recognize that this is a classic race condition.
-    So we allocate it now before we start any threads. Let's also copy the filename of our movie
-    into our VideoState.
-    */
+/* Null video sink for -headless: take pictures as soon as they are queued,
+   until the decoders of every session drained, then print the pipeline
+   statistics of each. Returns the number of sessions whose picture
+   timestamps went backwards. */
+static int headless_sink(Player *pl) {
+    int64_t start = av_gettime();
+    VideoState *is;
+    int i, busy, got, failed = 0;
 
-    strcpy(is->filename, argv[1]);
+    for(;;) {
+        busy = got = 0;
+        for(i = 0; i < pl->nb_sessions; i++) {
+            is = pl->sessions[i];
+            if(headless_done(is)) {
+                continue;
+            }
+            busy++;
+            while(is->pictq_size) {
+                stream_first_frame(is);
+                pictq_next_picture(is);
+                probes_tick(is);
+                got++;
+            }
+        }
+        if(!busy) {
+            break;
+        }
+        if(got) {
+            continue;
+        }
+        SDL_LockMutex(pl->present_mutex);
+        for(i = 0; i < pl->nb_sessions; i++) {
+            is = pl->sessions[i];
+            if(is->pictq_size) {
+                break;
+            }
+        }
+        if(i == pl->nb_sessions) {
+            SDL_CondWaitTimeout(pl->present_cond, pl->present_mutex, PRESENT_POLL_MS);
+        }
+        SDL_UnlockMutex(pl->present_mutex);
+    }
 
-    is->pictq_mutex = SDL_CreateMutex();
-    is->pictq_cond = SDL_CreateCond();
+    for(i = 0; i < pl->nb_sessions; i++) {
+        if(pl->nb_sessions > 1) {
+            fprintf(stderr, "%s:\n", pl->sessions[i]->filename);
+        }
+        probes_print(pl->sessions[i], av_gettime() - start);
+        failed += pl->sessions[i]->video_pts_errors > 0;
+    }
+    if(failed) {
+        /* what the non-zero exit status is for */
+        fprintf(stderr, "headless: %d of %d inputs had pictures with non-monotonic timestamps\n",
+                failed, pl->nb_sessions);
+    }
+    return failed;
+}
 
-    /*
-    pstrcpy is a function from ffmpeg that does some extra bounds checking beyond strncpy.
-    OUR FIRST THREAD
+enum {
+    OPT_BOOL,
+    OPT_INT,
+    OPT_DOUBLE,
+    OPT_STRING,
+};
 
-    Now let's finally launch our threads and get the real work done
-    */
+typedef struct OptionDef {
+    const char *name;
+    int type;
+    size_t offset; /* into PlayerOptions */
+    const char *help;
+} OptionDef;
+
+#define OPT_OFFSET(field) offsetof(PlayerOptions, field)
+
+static const OptionDef options[] = {
+    { "aqmax", OPT_INT, OPT_OFFSET(audioq_max_size), "audio queue byte cap" },
+    { "aqmin", OPT_INT, OPT_OFFSET(audioq_min_size), "audio queue byte low-water mark" },
+    { "aqmaxdur", OPT_INT, OPT_OFFSET(audioq_max_duration), "audio queue high-water mark in ms (0 = off)" },
+    { "aqmindur", OPT_INT, OPT_OFFSET(audioq_min_duration), "audio queue low-water mark in ms" },
+    { "vqmax", OPT_INT, OPT_OFFSET(videoq_max_size), "video queue byte cap" },
+    { "vqmin", OPT_INT, OPT_OFFSET(videoq_min_size), "video queue byte low-water mark" },
+    { "vqmaxdur", OPT_INT, OPT_OFFSET(videoq_max_duration), "video queue high-water mark in ms (0 = off)" },
+    { "vqmindur", OPT_INT, OPT_OFFSET(videoq_min_duration), "video queue low-water mark in ms" },
+    { "probesize", OPT_INT, OPT_OFFSET(probe_size), "bytes read to find the streams (0 = FFmpeg's default)" },
+    { "analyzeduration", OPT_INT, OPT_OFFSET(analyze_ms), "ms of media analyzed to find the streams (0 = FFmpeg's default)" },
+    { "membudget", OPT_INT, OPT_OFFSET(mem_budget_kb), "packet queue memory over all inputs in KB, split by bit rate (0 = off)" },
+    { "pictq", OPT_INT, OPT_OFFSET(pictq_depth), "number of decoded pictures to buffer (1-16)" },
+    { "convthreads", OPT_INT, OPT_OFFSET(convert_threads), "worker threads running demux, decode, conversion and background scans (0 = one per core)" },
+    { "convbench", OPT_INT, OPT_OFFSET(convert_bench), "report conversion frames/s per thread count over N frames, also at 10 bits; fail if slicing changes the output" },
+    { "threads", OPT_INT, OPT_OFFSET(video_threads), "video decoder threads (0 = one per core)" },
+    { "threadtype", OPT_STRING, OPT_OFFSET(video_thread_type), "video decoder threading: frame, slice or auto" },
+    { "readahead", OPT_INT, OPT_OFFSET(readahead_kb), "read-ahead buffer for local files in KB (0 = off)" },
+    { "mmap", OPT_BOOL, OPT_OFFSET(mmap_input), "map local files instead of reading them ahead" },
+    { "iobench", OPT_BOOL, OPT_OFFSET(io_bench), "report bytes copied per media second by the read-ahead and mmap inputs" },
+    { "synctest", OPT_BOOL, OPT_OFFSET(sync_test), "check audio resync against drifting master clocks, fail if it does not hold" },
+    { "poolmax", OPT_INT, OPT_OFFSET(pool_max_kb), "packet payload pool cap per input in KB (0 = no pool)" },
+    { "audiobuf", OPT_INT, OPT_OFFSET(audio_ring_ms), "decoded audio buffered ahead of the device in ms" },
+    { "speed", OPT_DOUBLE, OPT_OFFSET(speed), "playback speed, 0.25 to 4" },
+    { "sync", OPT_STRING, OPT_OFFSET(sync_type), "master clock: audio, video or ext" },
+    { "headless", OPT_BOOL, OPT_OFFSET(headless), "decode as fast as possible without display or audio, then report" },
+    { "stats", OPT_STRING, OPT_OFFSET(stats_file), "dump probe histograms and counters to a file (- for stderr)" },
+    { "stats_format", OPT_STRING, OPT_OFFSET(stats_format), "stats dump format: json or csv" },
+    { "stats_interval", OPT_INT, OPT_OFFSET(stats_interval), "ms between stats dumps (0 = on exit only)" },
+    { NULL },
+};
 
-    schedule_refresh(is, 40);
-    is->av_sync_type = DEFAULT_AV_SYNC_TYPE;
+static void show_usage(const char *prog) {
+    const OptionDef *po;
 
-    is->parse_tid = SDL_CreateThread(decode_thread, is);
-    if(!is->parse_tid) {
-        av_free(is);
-        return -1;
+    fprintf(stderr, "usage: %s [options] input_file [input_file...]\n", prog);
+    for(po = options; po->name; po++) {
+        fprintf(stderr, "  -%-12s %s\n", po->name, po->help);
     }
+    fprintf(stderr, "keys: left/right seek 10s, down/up seek 1 minute, space pause, [ ] speed, tab next input\n");
+}
 
-    for(;;) {
-
-        SDL_WaitEvent(&event);
-        switch(event.type) {
-        case FF_QUIT_EVENT:
-        case SDL_QUIT:
-            is->quit = 1;
-            SDL_Quit();
-            return 0;
+/* Fill 'opts' from the command line and 'filenames' with the inputs,
+   return their number or -1. */
+static int parse_options(PlayerOptions *opts, const char **filenames, int argc, char *argv[]) {
+    const OptionDef *po;
+    int i, nb_files = 0;
+
+    for(i = 1; i < argc; i++) {
+        if(argv[i][0] != '-') {
+            if(nb_files >= MAX_SESSIONS) {
+                fprintf(stderr, "%s: at most %d inputs\n", argv[i], MAX_SESSIONS);
+                return -1;
+            }
+            filenames[nb_files++] = argv[i];
+            continue;
+        }
+        for(po = options; po->name; po++) {
+            if(!strcmp(argv[i] + 1, po->name))
+                break;
+        }
+        if(!po->name || (po->type != OPT_BOOL && i + 1 >= argc)) {
+            fprintf(stderr, "%s: unknown option or missing argument\n", argv[i]);
+            return -1;
+        }
+        if(po->type == OPT_BOOL) {
+            *(int *)((uint8_t *)opts + po->offset) = 1;
+            continue;
+        }
+        i++;
+        switch(po->type) {
+        case OPT_INT:
+            *(int *)((uint8_t *)opts + po->offset) = atoi(argv[i]);
             break;
-        case FF_ALLOC_EVENT:
-            alloc_picture(event.user.data1);
+        case OPT_DOUBLE:
+            *(double *)((uint8_t *)opts + po->offset) = atof(argv[i]);
             break;
-        case FF_REFRESH_EVENT:
-            video_refresh_timer(event.user.data1);
+        case OPT_STRING:
+            *(const char **)((uint8_t *)opts + po->offset) = argv[i];
             break;
-        default:
+        }
+    }
+    return nb_files;
+}
+
+/* compare the visible part of two YUV420P pictures */
+static int picture_equal_yuv420p(AVPicture *a, AVPicture *b, int width, int height) {
+    int i, y, w, h;
+
+    for(i = 0; i < 3; i++) {
+        w = i ? (width + 1) >> 1 : width;
+        h = i ? (height + 1) >> 1 : height;
+        for(y = 0; y < h; y++) {
+            if(memcmp(a->data[i] + y * a->linesize[i], b->data[i] + y * b->linesize[i], w)) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+/* Time the conversion of 'src' to YUV420P with 1, 2, 4, ... threads, always
+   ending with max_threads. A single thread converts the picture in one
+   piece, every sliced result must match it. Returns the number of thread
+   counts that did not, -1 on error. */
+static int convert_benchmark_run(AVPicture *src, int src_fmt, int width, int height,
+                                 int nb_frames, int max_threads) {
+    AVPicture dst, ref;
+    Executor *exec;
+    ConvertJob job;
+    int64_t start;
+    int i, threads, same, failed = 0;
+
+    if(avpicture_alloc(&dst, PIX_FMT_YUV420P, width, height) < 0) {
+        return -1;
+    }
+    if(avpicture_alloc(&ref, PIX_FMT_YUV420P, width, height) < 0) {
+        avpicture_free(&dst);
+        return -1;
+    }
+    convert_job_init(&job);
+    for(threads = 1; ; threads = FFMIN(threads * 2, max_threads)) {
+        /* a slice left out must not pass for the previous run's */
+        memset(dst.data[0], 0, avpicture_get_size(PIX_FMT_YUV420P, width, height));
+        exec = executor_create(threads);
+        start = av_gettime();
+        for(i = 0; i < nb_frames; i++) {
+            convert_run(exec, &job, TASK_PRIO_FOCUS, src, src_fmt,
+                        &dst, PIX_FMT_YUV420P, width, height, SWS_BICUBIC);
+        }
+        if(threads == 1) {
+            av_picture_copy(&ref, &dst, PIX_FMT_YUV420P, width, height);
+            same = 1;
+        } else {
+            same = picture_equal_yuv420p(&ref, &dst, width, height);
+            failed += !same;
+        }
+        printf("threads %2d: %8.1f frames/s, %d of %d tasks stolen%s\n", threads,
+               nb_frames * 1000000.0 / FFMAX(av_gettime() - start, 1),
+               exec->stolen, exec->executed, same ? "" : ", output DIFFERS from 1 thread");
+        executor_free(exec);
+        if(threads >= max_threads) {
             break;
         }
     }
 
-    return 0;
+    convert_job_free(&job);
+    avpicture_free(&ref);
+    avpicture_free(&dst);
+    return failed;
+}
+
+/* Decode the first video frame of the file and time its conversion with an
+   increasing number of threads, then the same for a 10-bit copy of it.
+   Returns the number of runs whose sliced output was wrong, -1 on error. */
+static int convert_benchmark(const char *filename, int nb_frames, int max_threads) {
+    AVFormatContext *pFormatCtx;
+    AVCodecContext *codecCtx = NULL;
+    AVCodec *codec;
+    AVPacket packet;
+    AVFrame *pFrame;
+    AVPicture hbd;
+    struct SwsContext *ctx;
+    int i, ret, failed, frameFinished = 0;
+
+    pFormatCtx = NULL;
+    if(avformat_open_input(&pFormatCtx, filename, NULL, NULL) != 0 ||
+       avformat_find_stream_info(pFormatCtx, NULL) < 0) {
+        fprintf(stderr, "%s: could not open file\n", filename);
+        return -1;
+    }
+    for(i = 0; i < (int)pFormatCtx->nb_streams; i++) {
+        if(pFormatCtx->streams[i]->codec->codec_type == AVMEDIA_TYPE_VIDEO) {
+            codecCtx = pFormatCtx->streams[i]->codec;
+            break;
+        }
+    }
+    codec = codecCtx ? avcodec_find_decoder(codecCtx->codec_id) : NULL;
+    if(!codec || avcodec_open2(codecCtx, codec, NULL) < 0) {
+        fprintf(stderr, "%s: could not open video codec\n", filename);
+        return -1;
+    }
 
+    pFrame = avcodec_alloc_frame();
+    while(!frameFinished && av_read_frame(pFormatCtx, &packet) >= 0) {
+        if(pFormatCtx->streams[packet.stream_index]->codec == codecCtx) {
+            avcodec_decode_video2(codecCtx, pFrame, &frameFinished, &packet);
+        }
+        av_free_packet(&packet);
+    }
+    if(!frameFinished) {
+        fprintf(stderr, "%s: could not decode a video frame\n", filename);
+        return -1;
+    }
 
+    printf("%dx%d, %d frames per run\n", codecCtx->width, codecCtx->height, nb_frames);
+    printf("decoded format:\n");
+    failed = convert_benchmark_run((AVPicture *)pFrame, codecCtx->pix_fmt,
+                                   codecCtx->width, codecCtx->height, nb_frames, max_threads);
 
+    /* the same picture at 10 bits, which is sliced too */
+    if(failed >= 0) {
+        if(avpicture_alloc(&hbd, PIX_FMT_YUV420P10, codecCtx->width, codecCtx->height) < 0) {
+            failed = -1;
+        } else {
+            ctx = sws_getContext(codecCtx->width, codecCtx->height, codecCtx->pix_fmt,
+                                 codecCtx->width, codecCtx->height, PIX_FMT_YUV420P10,
+                                 SWS_BICUBIC, NULL, NULL, NULL);
+            if(ctx) {
+                sws_scale(ctx, pFrame->data, pFrame->linesize, 0, codecCtx->height,
+                          hbd.data, hbd.linesize);
+                sws_freeContext(ctx);
+                printf("yuv420p10:\n");
+                ret = convert_benchmark_run(&hbd, PIX_FMT_YUV420P10, codecCtx->width,
+                                            codecCtx->height, nb_frames, max_threads);
+                failed = ret < 0 ? ret : failed + ret;
+            } else {
+                failed = -1;
+            }
+            avpicture_free(&hbd);
+        }
+    }
 
+    av_free(pFrame);
+    avcodec_close(codecCtx);
+    avformat_close_input(&pFormatCtx);
+    return failed;
+}
 
+/* Play simulated audio on devices running fast or slow against the
+   external clock and check that synchronize_audio keeps them together.
+   Every frame goes through audio_convert, so the device plays what
+   swresample's compensation actually produced. Both clocks stay paused and
+   are set by hand, so nothing really waits. Returns the number of drift
+   rates that were not held. */
+static int sync_test(void) {
+    static const int drift_ppm[] = { -50000, -10000, -1000, -100, 100, 1000, 10000, 50000 };
+    static int16_t samples[SDL_AUDIO_BUFFER_SIZE];
+    VideoState *is;
+    AVStream st;
+    AVFrame *frame;
+    double t, media, diff, max_diff, bound;
+    int i, nb, wanted, played, failed = 0, n = sizeof(drift_ppm) / sizeof(drift_ppm[0]);
 
+    is = (VideoState *)av_mallocz(sizeof(VideoState));
+    memset(&st, 0, sizeof(st));
+    st.codec = avcodec_alloc_context3(NULL);
+    frame = avcodec_alloc_frame();
+    if(!is || !st.codec || !frame) {
+        fprintf(stderr, "Could not allocate the sync test\n");
+        return -1;
+    }
+    st.codec->sample_rate = 48000;
+    st.codec->channels = 1;
+    nb = SDL_AUDIO_BUFFER_SIZE;
+    /* a 1 kHz tone in, mono S16 out at the same rate */
+    for(i = 0; i < nb; i++) {
+        samples[i] = (int16_t)(8192 * sin(2 * M_PI * 1000 * i / st.codec->sample_rate));
+    }
+    frame->data[0] = (uint8_t *)samples;
+    frame->linesize[0] = sizeof(samples);
+    frame->extended_data = frame->data;
+    frame->nb_samples = nb;
+    frame->format = AV_SAMPLE_FMT_S16;
+    is->audio_tgt_fmt = AV_SAMPLE_FMT_S16;
+    is->audio_tgt_freq = st.codec->sample_rate;
+    is->audio_tgt_channels = 1;
+    is->audio_tgt_layout = av_get_default_channel_layout(1);
+    is->audio_tgt_frame_size = 2;
+    is->audio_st = &st;
+    is->av_sync_type = AV_SYNC_EXTERNAL_MASTER;
+    /* same averaging and threshold as stream_component_open */
+    is->audio_diff_avg_coef = exp(log(0.01) / AUDIO_DIFF_AVG_NB);
+    is->audio_diff_threshold = 2.0 * SDL_AUDIO_BUFFER_SIZE / st.codec->sample_rate;
+    /* corrections start once the average error passes the threshold, the
+       error left should not exceed it by more than a frame */
+    bound = is->audio_diff_threshold + (double)nb / st.codec->sample_rate;
+
+    for(i = 0; i < n; i++) {
+        clock_init(&is->audclk);
+        clock_init(&is->extclk);
+        clock_set_paused(&is->audclk, 1);
+        clock_set_paused(&is->extclk, 1);
+        is->audio_diff_cum = 0;
+        is->audio_diff_avg_count = 0;
+        swr_free(&is->swr_ctx);
+        t = media = max_diff = 0;
+        while(t < SYNC_TEST_SECONDS) {
+            clock_set_at(&is->extclk, t, t);
+            clock_set_at(&is->audclk, media, t);
+            wanted = synchronize_audio(is, nb);
+            played = audio_convert(is, frame, wanted, AV_SAMPLE_FMT_S16);
+            if(played < 0) {
+                failed = -1;
+                goto end;
+            }
+            played /= is->audio_tgt_frame_size;
+            if(t >= SYNC_TEST_SETTLE) {
+                diff = fabs(media - t);
+                max_diff = FFMAX(max_diff, diff);
+            }
+            /* the device plays what the resampler gave at its own rate,
+               for 'nb' samples of media */
+            t += played / (st.codec->sample_rate * (1.0 + drift_ppm[i] / 1000000.0));
+            media += (double)nb / st.codec->sample_rate;
+        }
+        printf("drift %+6d ppm: max A-V difference %5.1f ms (bound %.1f ms) %s\n",
+               drift_ppm[i], max_diff * 1000.0, bound * 1000.0,
+               max_diff > bound ? "FAILED" : "ok");
+        failed += max_diff > bound;
+    }
 
+end:
+    swr_free(&is->swr_ctx);
+    av_free(is->audio_buf);
+    av_free(frame);
+    av_free(st.codec);
+    av_free(is);
+    return failed;
+}
 
+/* Demux the whole file with each input mode and count the bytes copied on
+   the way to the packets. */
+static int io_benchmark(const char *filename, const PlayerOptions *opts) {
+    static const char *const modes[] = { "read-ahead", "mmap" };
+    Executor *exec;
+    VideoState *is;
+    AVFormatContext *ic;
+    AVIOContext *pb;
+    AVPacket pkt;
+    int64_t start, payload, copied;
+    double media;
+    int mode, used, dups;
+
+    /* fills the read-ahead ring, as in playback */
+    exec = executor_create(opts->convert_threads);
+    if(!exec) {
+        return -1;
+    }
+    for(mode = 0; mode < 2; mode++) {
+        is = (VideoState *)av_mallocz(sizeof(VideoState));
+        strncpy(is->filename, filename, sizeof(is->filename) - 1);
+        is->opts = *opts;
+        is->opts.mmap_input = mode;
+        is->opts.readahead_kb = FFMAX(opts->readahead_kb, AVIO_BUFFER_SIZE / 1024);
+        ic = avformat_alloc_context();
+        pb = ic->pb = input_avio(is, exec);
+        if(!pb || avformat_open_input(&ic, filename, NULL, NULL) != 0) {
+            fprintf(stderr, "%s: could not open as a local file\n", filename);
+            return -1;
+        }
+        /* input_avio reads ahead when the mapping fails, report what ran */
+        used = is->mmap_reader.map ? 1 : 0;
+        if(used != mode) {
+            fprintf(stderr, "%s: could not map the file, %s run reads ahead instead\n",
+                    filename, modes[mode]);
+        }
+        start = av_gettime();
+        payload = copied = 0;
+        dups = 0;
+        while(av_read_frame(ic, &pkt) >= 0) {
+            payload += pkt.size;
+            if(!pkt.destruct) {
+                dups++;
+                copied += pkt.size;
+            }
+            av_free_packet(&pkt);
+        }
+        if(is->mmap_reader.map) {
+            /* direct reads, the copy out of the mapping is the payload's */
+            copied += is->mmap_reader.bytes_copied;
+        } else {
+            /* into the ring, out of it, then from the AVIOContext buffer */
+            copied += is->readahead.bytes_read + is->readahead.bytes_copied + payload;
+        }
+        media = ic->duration > 0 ? ic->duration / (double)AV_TIME_BASE : 1.0;
+        printf("%-10s %8.1f MB payload, %8.1f MB copied, %8.1f KB copied per media second, "
+               "%d packets duplicated, %.3fs\n", modes[used], payload / 1048576.0,
+               copied / 1048576.0, copied / 1024.0 / media, dups,
+               (av_gettime() - start) / 1000000.0);
+        avformat_close_input(&ic);
+        input_avio_free(pb);
+        readahead_close(&is->readahead);
+        mapped_file_unref(is->mmap_reader.map);
+        av_free(is);
+    }
+    executor_free(exec);
+    return 0;
+}
 
+/* lets FFmpeg serialize codec opening with SDL mutexes */
+static int lockmgr(void **mtx, enum AVLockOp op) {
+    switch(op) {
+    case AV_LOCK_CREATE:
+        *mtx = SDL_CreateMutex();
+        return !*mtx;
+    case AV_LOCK_OBTAIN:
+        return !!SDL_LockMutex((SDL_mutex *)*mtx);
+    case AV_LOCK_RELEASE:
+        return !!SDL_UnlockMutex((SDL_mutex *)*mtx);
+    case AV_LOCK_DESTROY:
+        SDL_DestroyMutex((SDL_mutex *)*mtx);
+        return 0;
+    }
+    return 1;
 }
 
+int main (int argc, char *argv[]) {
+
+    Player player, *pl = &player;
+    VideoState *is;
+    PlayerOptions opts;
+    const char *filenames[MAX_SESSIONS];
+    int i, nb_files, ret = 0;
+
+    memset(&opts, 0, sizeof(opts));
+    opts.audioq_max_size = MAX_AUDIOQ_SIZE;
+    opts.audioq_min_size = MIN_AUDIOQ_SIZE;
+    opts.videoq_max_size = MAX_VIDEOQ_SIZE;
+    opts.videoq_min_size = MIN_VIDEOQ_SIZE;
+    opts.audioq_max_duration = opts.videoq_max_duration = QUEUE_MAX_MS;
+    opts.audioq_min_duration = opts.videoq_min_duration = QUEUE_MIN_MS;
+    opts.mem_budget_kb = MEM_BUDGET_KB;
+    opts.probe_size = PROBE_SIZE;
+    opts.analyze_ms = ANALYZE_MS;
+    opts.pictq_depth = VIDEO_PICTURE_QUEUE_SIZE;
+    opts.convert_threads = 0;
+    opts.video_threads = 0;
+    opts.video_thread_type = "auto";
+    opts.audio_ring_ms = AUDIO_RING_MS;
+    opts.speed = 1.0;
+    opts.sync_type = "audio";
+    opts.readahead_kb = READAHEAD_KB;
+    opts.pool_max_kb = POOL_MAX_KB;
+
+    nb_files = parse_options(&opts, filenames, argc, argv);
+    if(nb_files >= 0 && opts.sync_test) {
+        /* needs no input */
+        return sync_test() != 0;
+    }
+    if(nb_files <= 0){
+        cout << "Please specify an input file\n";
+        show_usage(argv[0]);
+        return -1;
+    }
+    if(sync_type_from_name(opts.sync_type) < 0) {
+        fprintf(stderr, "%s: unknown -sync, use audio, video or ext\n", opts.sync_type);
+        return -1;
+    }
+    if(opts.convert_threads <= 0) {
+        opts.convert_threads = FFMIN(get_cpu_count(), EXEC_THREADS_MAX);
+    }
+    if(opts.video_threads <= 0) {
+        /* the sessions share the cores */
+        opts.video_threads = FFMAX(get_cpu_count() / nb_files, 1);
+    }
+
+    av_register_all();
+    /* codecs are opened from several threads at once */
+    if(av_lockmgr_register(lockmgr)) {
+        fprintf(stderr, "Could not initialize the codec lock manager\n");
+        return -1;
+    }
+    av_init_packet(&flush_pkt);
+    flush_pkt.data = (uint8_t *)"FLUSH";
+
+    if(opts.convert_bench > 0) {
+        /* SDL threads only, no display or audio needed */
+        if(SDL_Init(SDL_INIT_NOPARACHUTE)) {
+            fprintf(stderr, "Could not initialize SDL - %s\n", SDL_GetError());
+            exit(1);
+        }
+        return convert_benchmark(filenames[0], opts.convert_bench, opts.convert_threads) != 0;
+    }
+    if(opts.io_bench) {
+        if(SDL_Init(SDL_INIT_NOPARACHUTE)) {
+            fprintf(stderr, "Could not initialize SDL - %s\n", SDL_GetError());
+            exit(1);
+        }
+        return io_benchmark(filenames[0], &opts) < 0;
+    }
+
+    if(SDL_Init(opts.headless ? SDL_INIT_NOPARACHUTE :
+                SDL_INIT_VIDEO | SDL_INIT_AUDIO)) {
+        fprintf(stderr, "Could not initialize SDL - %s\n", SDL_GetError());
+        exit(1);
+    }
+
+    memset(pl, 0, sizeof(*pl));
+    pl->headless = opts.headless;
+    pl->audio_mutex = SDL_CreateMutex();
+    pl->present_mutex = SDL_CreateMutex();
+    pl->present_cond = SDL_CreateCond();
+    pl->budget_mutex = SDL_CreateMutex();
+    pl->mem_budget = (int64_t)FFMAX(opts.mem_budget_kb, 0) * 1024;
+    /* one set of worker threads runs the stages of all sessions */
+    pl->exec = executor_create(opts.convert_threads);
+    if(!pl->exec) {
+        exit(1);
+    }
+
+    if(!opts.headless && nb_files > 1) {
+        /* several sessions share a grid, a single one opens the window at
+           the size of its video once it knows it */
+        if(player_set_video_mode(pl, MULTI_WINDOW_W, MULTI_WINDOW_H) < 0) {
+            cerr << "SDL: could not set video mode - exiting\n";
+            exit(1);
+        }
+    }
+
+    /* every session has its own stages, queues and clocks, see stream_open */
+    for(i = 0; i < nb_files; i++) {
+        if(!stream_open(pl, filenames[i], &opts)) {
+            return -1;
+        }
+    }
+    for(i = 0; i < pl->nb_sessions; i++) {
+        if(probes_open(pl->sessions[i]) < 0) {
+            return -1;
+        }
+    }
+    for(i = 0; i < pl->nb_sessions; i++) {
+        is = pl->sessions[i];
+        schedule_refresh(is, 40000);
+        stage_start(&is->demux_stage, pl->exec, is, stream_open_step);
+    }
+
+    if(opts.headless) {
+        /* a scripted run fails on pictures out of order */
+        ret = headless_sink(pl) > 0;
+    } else {
+        presentation_loop(pl);
+    }
 
+    for(i = 0; i < pl->nb_sessions; i++) {
+        is = pl->sessions[i];
+        stream_close(is);
+#if ENABLE_PROBES
+        if(!opts.headless && is->probes.hist[PROBE_FRAME_INTERVAL].count) {
+            Histogram *late = &is->probes.hist[PROBE_PRESENT_LATE];
+            Histogram *interval = &is->probes.hist[PROBE_FRAME_INTERVAL];
+
+            fprintf(stderr, "%s display: %u pictures, late p50 %dus p99 %dus max %dus, interval p50 %dus p99 %dus max %dus\n",
+                    is->filename, late->count, (int)hist_percentile(late, 50),
+                    (int)hist_percentile(late, 99), (int)late->max,
+                    (int)hist_percentile(interval, 50),
+                    (int)hist_percentile(interval, 99), (int)interval->max);
+        }
+#endif
+        probes_close(is);
+    }
+    for(i = 0; i < pl->nb_sessions; i++) {
+        stream_wait(pl->sessions[i]);
+    }
+    /* the callback mixes the sessions */
+    SDL_CloseAudio();
+    if(opts.stats_file) {
+        fprintf(stderr, "executor: %d workers, %d tasks, %d stolen\n",
+                pl->exec->nb_workers, pl->exec->executed, pl->exec->stolen);
+    }
+    /* joins the workers, the background scans included */
+    executor_free(pl->exec);
+    for(i = 0; i < pl->nb_sessions; i++) {
+        stream_free(pl->sessions[i]);
+    }
+    SDL_DestroyMutex(pl->audio_mutex);
+    SDL_DestroyCond(pl->present_cond);
+    SDL_DestroyMutex(pl->present_mutex);
+    SDL_DestroyMutex(pl->budget_mutex);
+    SDL_Quit();
+    return ret;
+}